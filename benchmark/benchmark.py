@@ -2,21 +2,340 @@ import os
 import random
 import subprocess
 import sys
+import threading
 import time
 
 random.seed(0)
-n = 1
 
-for i in range(n):
-    filepath = f'files/{i}.in'
+
+def write(filepath, generate):
     if not os.path.exists(filepath):
         print(f'Writing {filepath}')
+        os.makedirs(os.path.dirname(filepath), exist_ok=True)
         with open(filepath, 'w') as f:
-            f.write(''.join([str(random.randint(0, 1)) for _ in range(100_000_000)]))
-
-out = open('out', 'w')
-print('Running minigrep')
-t0 = time.time()
-subprocess.run([sys.argv[1], '.', '111'], stdout=out)
-out.close()
-print(f'{time.time() - t0} seconds elapsed')
+            f.write(generate())
+
+
+def run(args, out='out'):
+    with open(out, 'w') as f:
+        t0 = time.time()
+        subprocess.run(args, stdout=f)
+        return time.time() - t0
+
+
+def basic(minigrep):
+    n = 1
+
+    for i in range(n):
+        write(f'files/{i}.in', lambda: ''.join([str(random.randint(0, 1)) for _ in range(100_000_000)]))
+
+    print('Running minigrep')
+    print(f'{run([minigrep, "files", "111"])} seconds elapsed')
+
+
+def planner(minigrep):
+    # 8 directories of 25 files of text from a small vocabulary
+    # 'quokka' occurs in every file of one directory, 'zebra' in a single file
+    vocabulary = [''.join(random.choices('abcdefghilmnoprstu', k=random.randint(2, 8))) for _ in range(300)]
+    for d in range(8):
+        for i in range(25):
+            extra = ['quokka'] * 50 if d == 0 else []
+            extra += ['zebra'] if (d, i) == (7, 24) else []
+
+            def generate():
+                words = random.choices(vocabulary, k=70_000) + extra
+                random.shuffle(words)
+                return ' '.join(words)
+
+            write(f'planner/{d}/{i}.in', generate)
+
+    print('Indexing')
+    subprocess.run([minigrep, '--index=planner.index', 'index', 'planner'])
+    print(f'{"needle":8} {"chosen plan":40} {"index":>8} {"scan":>8} {"auto":>8}')
+    for needle in ['zebra', 'quokka', 'xyz', 'ab']:
+        explain = subprocess.run([minigrep, '--index=planner.index', '--explain', 'planner', needle],
+                                 capture_output=True, text=True).stdout
+        chosen = ' '.join(f'{line.split(":")[0]}={line.split()[1][0]}' for line in explain.splitlines())
+        times = [run([minigrep, '--index=planner.index', f'--plan={plan}', 'planner', needle])
+                 for plan in ['index', 'scan', 'auto']]
+        print(f'{needle:8} {chosen:40} ' + ' '.join(f'{t:7.3f}s' for t in times))
+
+
+def deadline(minigrep):
+    # 20 files behind a FUSE stub that delays 5% of the reads by 0.5 s, plus one file whose reads never return
+    for i in range(20):
+        write(f'deadline/source/{i}.in', lambda: ''.join(random.choices('ab\n', k=2_000_000)))
+    write('deadline/source/hang.in', lambda: 'abab')
+    os.makedirs('deadline/mount', exist_ok=True)
+    slowfs = subprocess.Popen([sys.executable, os.path.join(os.path.dirname(__file__), 'slowfs.py'),
+                               'deadline/source', 'deadline/mount', '0.5', '0.05'])
+    try:
+        time.sleep(1)
+        for options in [[], ['--hedge']]:
+            t = run([minigrep, '--read-timeout=2000', '--stats'] + options + ['deadline/mount', 'abab'])
+            print(f'{" ".join(options) or "no hedging":12} {t:.3f} seconds elapsed')
+    finally:
+        subprocess.run(['fusermount', '-u', 'deadline/mount'])
+        slowfs.wait()
+
+
+def evict(directory):
+    for name in os.listdir(directory):
+        fd = os.open(os.path.join(directory, name), os.O_RDONLY)
+        os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+        os.close(fd)
+
+
+def physical(minigrep):
+    # 400 files of 1 MB created in shuffled order, so that their names and their blocks are ordered differently
+    # the difference shows on a rotational disk, for example a loop device over a file on one or a throttled device
+    order = list(range(400))
+    random.shuffle(order)
+    for i in order:
+        write(f'physical/{i}.in', lambda: ''.join(random.choices('ab\n', k=1_000_000)))
+    for option in ['--order=directory', '--order=physical']:
+        evict('physical')
+        print(f'{option:18} {run([minigrep, option, "physical", "abba"]):.3f} seconds elapsed')
+
+
+def stat(stats, key):
+    return next(line.split(':', 1)[1].split()[0] for line in stats.splitlines() if line.startswith(key + ':'))
+
+
+def lpt(minigrep):
+    # 300 small files and a few large ones, whose chunks end up at the back in directory order when they come last
+    for i in range(300):
+        write(f'lpt/small/{i}.in', lambda: ''.join(random.choices('ab\n', k=random.randint(1_000, 300_000))))
+    for i in range(3):
+        write(f'lpt/zlarge/{i}.in', lambda: ''.join(random.choices('ab\n', k=50_000_000)))
+    print(f'{"order":10} {"makespan":>10} {"idle":>10}')
+    for order in ['directory', 'size-desc']:
+        stats = subprocess.run([minigrep, '--stats', f'--order={order}', 'lpt', 'abba'], stdout=subprocess.DEVNULL,
+                               stderr=subprocess.PIPE, text=True).stderr
+        print(f'{order:10} {float(stat(stats, "elapsed")):9.3f}s {float(stat(stats, "idle")):9.3f}s')
+
+
+def split(minigrep):
+    # two large files and many small ones, searched with chunks cut up front and with chunks split on steal
+    for i in range(2):
+        write(f'split/large/{i}.in', lambda: ''.join(random.choices('ab\n', k=100_000_000)))
+    for i in range(200):
+        write(f'split/small/{i}.in', lambda: ''.join(random.choices('ab\n', k=random.randint(1_000, 500_000))))
+    print(f'{"split":8} {"elapsed":>10} {"chunks":>8} {"steals":>8} {"idle":>10}')
+    for mode in ['static', 'lazy']:
+        t0 = time.time()
+        stats = subprocess.run([minigrep, '--stats', f'--split={mode}', 'split', 'abba'], stdout=subprocess.DEVNULL,
+                               stderr=subprocess.PIPE, text=True).stderr
+        elapsed = time.time() - t0
+        print(f'{mode:8} {elapsed:9.3f}s {stat(stats, "chunks"):>8} {stat(stats, "steals"):>8} '
+              f'{float(stat(stats, "idle")):9.3f}s')
+
+
+def first_hit(args):
+    t0 = time.time()
+    process = subprocess.Popen(args, stdout=subprocess.PIPE, text=True)
+    process.stdout.readline()
+    elapsed = time.time() - t0
+    process.kill()
+    process.wait()
+    return elapsed
+
+
+def priority(minigrep):
+    # 500 files of 1 MB without the search string, and the most recently modified one with it
+    for i in range(500):
+        write(f'priority/{i}.in', lambda: ''.join(random.choices('ab\n', k=1_000_000)))
+        os.utime(f'priority/{i}.in', (1_600_000_000 + i, 1_600_000_000 + i))
+    write('priority/recent.in', lambda: 'incident')
+    with open('priority.list', 'w') as f:
+        f.write('priority/recent.in\n')
+    print(f'{"order":24} {"first hit":>10} {"all":>10}')
+    for order in ['directory', 'mtime-desc', 'list:priority.list']:
+        args = [minigrep, f'--order={order}', 'priority', 'incident']
+        evict('priority')
+        hit = first_hit(args)
+        evict('priority')
+        print(f'{order:24} {hit:9.3f}s {run(args):9.3f}s')
+
+
+def table(minigrep):
+    # synthetic trees of up to 100M files, whose table spills beyond table_memory (needs about 6 GB of temporary space),
+    # built by table.cpp on top of minigrep.cpp
+    source = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'table.cpp')
+    subprocess.run([os.environ.get('CXX', 'c++'), '-std=c++20', '-O2', '-pthread', source, '-o', 'table'], check=True)
+    print(f'{"files":>10} {"table":>14} {"as objects":>18} {"peak rss":>12}')
+    for count in [1_000_000, 10_000_000, 100_000_000]:
+        report = subprocess.run(['./table', str(count)], capture_output=True, text=True).stdout
+        print(f'{count:>10} {stat(report, "table"):>11} MB {stat(report, "objects"):>15} MB '
+              f'{stat(report, "peak rss"):>9} MB')
+
+
+def serve(minigrep):
+    # queries against a daemon from several threads while another rebuilds the index and reloads it, and touches a
+    # file now and then so that the cached results of the queries are partly out of date
+    vocabulary = [''.join(random.choices('abcdefghilmnoprstu', k=random.randint(3, 6))) for _ in range(100)]
+    for d in range(4):
+        for i in range(25):
+            write(f'daemon/{d}/{i}.in', lambda: ' '.join(random.choices(vocabulary, k=20_000)))
+    needles = vocabulary[:20]
+    expected = {needle: subprocess.run([minigrep, 'daemon', needle], capture_output=True, text=True).stdout.count('\n')
+                for needle in needles}
+    subprocess.run([minigrep, '--index=daemon.index', 'index', 'daemon'], stderr=subprocess.DEVNULL)
+    daemon = subprocess.Popen([minigrep, '--index=daemon.index', 'serve', 'daemon'], stdin=subprocess.PIPE,
+                              stdout=subprocess.PIPE, text=True)
+    lock = threading.Lock()
+    sent, results, stats = [], [], []
+
+    def send(command, needle=None):
+        with lock:
+            if needle:
+                sent.append(needle)
+            daemon.stdin.write(command + '\n')
+            daemon.stdin.flush()
+
+    def query():
+        for _ in range(50):
+            needle = random.choice(needles)
+            send(f'search {needle}', needle)
+
+    def reload():
+        for _ in range(20):
+            os.utime(f'daemon/{random.randrange(4)}/{random.randrange(25)}.in')
+            subprocess.run([minigrep, '--index=daemon.next', 'index', 'daemon'], stderr=subprocess.DEVNULL)
+            os.replace('daemon.next', 'daemon.index')
+            send('reload')
+
+    def receive():
+        lines = iter(daemon.stdout)
+        for line in lines:
+            if line.startswith('query '):
+                query_id, count = int(line.split()[1][:-1]), int(line.split()[2])
+                results.append((query_id, count))
+                for _ in range(count):
+                    next(lines)
+            elif line.startswith('stats:') or line.startswith('cache:'):
+                stats.append(line.strip())
+
+    t0 = time.time()
+    receiver = threading.Thread(target=receive)
+    receiver.start()
+    threads = [threading.Thread(target=query) for _ in range(4)] + [threading.Thread(target=reload)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    while len(results) < len(sent):
+        time.sleep(0.01)
+    elapsed = time.time() - t0
+    send('stats')
+    daemon.stdin.close()
+    receiver.join()
+    daemon.wait()
+    wrong = sum(count != expected[sent[query_id - 1]] for query_id, count in results)
+    print(f'{len(results)} queries, {wrong} wrong, {elapsed:.3f} seconds elapsed')
+    print('\n'.join(stats))
+
+
+def scaling(minigrep):
+    # throughput by number of workers, chunk size, corpus size and cache state, written to scaling.csv
+    # scaling is flagged as flat where doubling the workers gains less than 10%; the limit is the output if runs without
+    # matches still scale there, the disk if a cold run takes twice as long as a hot one, and the cores otherwise
+    corpora = []
+    for count in [2_000, 20_000]:
+        for i in range(count):
+            write(f'scaling/tiny{count}/{i}.in', lambda: ''.join(random.choices('ab\n', k=4_000)))
+        corpora.append(('tiny files', f'scaling/tiny{count}'))
+    for size in [64_000_000, 512_000_000]:
+        write(f'scaling/large{size}/0.in', lambda: ''.join(random.choices('ab\n', k=64_000_000)) * (size // 64_000_000))
+        corpora.append(('one large file', f'scaling/large{size}'))
+    cpus = os.cpu_count() or 1
+    workers = sorted({2 ** i for i in range(cpus.bit_length())} | {cpus, 2 * cpus})
+
+    def measure(directory, cache, chunk, count, needle):
+        with open('scaling.profile', 'w') as f:
+            f.write(f'workers={count}\nmax_workers={count}\nchunk_size={chunk}\n')
+            for filesystem in ['other', 'tmpfs', 'ext4', 'xfs', 'btrfs', 'nfs', 'cifs', 'fuse']:
+                f.write(f'{filesystem}.read_size={chunk}\n')
+        if cache == 'cold':
+            evict(directory)
+        else:
+            run([minigrep, '--profile=scaling.profile', directory, needle], os.devnull)
+        return run([minigrep, '--profile=scaling.profile', directory, needle], os.devnull)
+
+    def scales(fewer, slower, more, faster):
+        return slower / faster >= 1 + 0.1 * (more - fewer) / fewer
+
+    rows = ['scenario,bytes,cache,chunk_size,workers,seconds,mb_per_s,speedup,efficiency,flat']
+    for scenario, directory in corpora:
+        size = sum(os.path.getsize(os.path.join(directory, name)) for name in os.listdir(directory))
+        for cache in ['hot', 'cold']:
+            for chunk in [256 << 10, 1 << 20, 4 << 20]:
+                times = {}
+                for count in workers:
+                    times[count] = measure(directory, cache, chunk, count, 'abba')
+                    flat = ''
+                    previous = max((c for c in times if c < count), default=None)
+                    if previous and not scales(previous, times[previous], count, times[count]):
+                        if scales(previous, measure(directory, cache, chunk, previous, 'zzzz'),
+                                  count, measure(directory, cache, chunk, count, 'zzzz')):
+                            flat = 'output'
+                        elif cache == 'cold' and measure(directory, 'hot', chunk, count, 'abba') < times[count] / 2:
+                            flat = 'io'
+                        else:
+                            flat = 'cpu'
+                    speedup = times[workers[0]] / times[count]
+                    rows.append(f'{scenario},{size},{cache},{chunk},{count},{times[count]:.3f},'
+                                f'{size / 1e6 / times[count]:.1f},{speedup:.2f},{speedup / count:.2f},{flat}')
+                    print(rows[-1])
+    with open('scaling.csv', 'w') as f:
+        f.write('\n'.join(rows) + '\n')
+    print('Wrote scaling.csv')
+
+
+def automaton(minigrep):
+    # a set of 100k patterns, whose automaton is some 100 MB and far exceeds L2, searched for in 50 MB of text by one
+    # worker scanning 1 to 8 parts of every chunk at once, then sharded as planned from the cache sizes and as forced
+    letters = 'abcdefghijklmnopqrstuvwxyz'
+    write('automaton/patterns', lambda: '\n'.join(''.join(random.choices(letters, k=random.randint(8, 16)))
+                                                  for _ in range(100_000)) + '\n')
+    write('automaton/text/0.in', lambda: ''.join(random.choices(letters + ' \n', k=50_000_000)))
+    def run(streams, memory):
+        with open('automaton.profile', 'w') as f:
+            f.write(f'workers=1\nmax_workers=1\nautomaton_streams={streams}\nautomaton_memory={memory}\n')
+        stats = subprocess.run([minigrep, '--stats', '--profile=automaton.profile', '--patterns=automaton/patterns',
+                                'automaton/text'], stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True).stderr
+        print(f'{streams:>8} {memory or "planned":>10} {stat(stats, "automaton"):>8} '
+              f'{float(stat(stats, "elapsed")):9.3f}s')
+        return int(stat(stats, 'automaton')), float(stat(stats, 'elapsed'))
+
+    print(f'{"streams":>8} {"memory":>10} {"shards":>8} {"elapsed":>10}')
+    for streams, memory in [(1, 0), (2, 0), (4, 0), (8, 0), (8, 1 << 20), (8, 8 << 20), (8, 32 << 20)]:
+        run(streams, memory)
+    # one stream waits for every load, so a single automaton in memory against shards in L2 times the loads
+    _, single = run(1, 2**31 - 1)
+    l2 = subprocess.run(['getconf', 'LEVEL2_CACHE_SIZE'], capture_output=True, text=True).stdout.strip()
+    shards, sharded = run(1, (int(l2) if l2.isdigit() and int(l2) else 2 << 20) // 2)
+    print(f'memory_load_cost={round(single / (sharded / shards))}')
+
+
+def sorted_runs(minigrep):
+    # --sorted with so little sort memory and a fan-in of 2 that the runs take several merge passes, checked against
+    # the unsorted output
+    for i in range(20):
+        write(f'sorted/{i}.in', lambda: ''.join(random.choices('ab\n', k=200_000)))
+    expected = subprocess.run([minigrep, 'sorted', 'abab'], capture_output=True, text=True).stdout.splitlines()
+    with open('sorted.profile', 'w') as f:
+        f.write('sort_memory=100000\nsort_fanin=2\n')
+    for run in range(3):
+        output = subprocess.run([minigrep, '--profile=sorted.profile', '--sorted', 'sorted', 'abab'],
+                                capture_output=True, text=True).stdout.splitlines()
+        print(f'run {run}: {len(output)} of {len(expected)} lines, '
+              f'{"same matches" if sorted(output) == sorted(expected) else "different matches"}')
+
+
+scenarios = {'basic': basic, 'planner': planner, 'deadline': deadline, 'physical': physical, 'lpt': lpt,
+             'split': split, 'priority': priority, 'table': table, 'serve': serve,
+             'scaling': scaling, 'automaton': automaton, 'sorted': sorted_runs}
+
+if __name__ == '__main__':
+    scenarios[sys.argv[2] if len(sys.argv) > 2 else 'basic'](sys.argv[1])
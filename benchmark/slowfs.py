@@ -0,0 +1,54 @@
+"""Read-only passthrough FUSE filesystem that delays reads, for testing read deadlines and hedging.
+
+Usage: python slowfs.py <source directory> <mount point> <delay seconds> [probability]
+Reads of files whose name contains 'hang' never return, other reads are delayed with the given probability.
+Requires fusepy (pip install fusepy).
+"""
+import errno
+import os
+import random
+import sys
+import threading
+import time
+
+from fuse import FUSE, FuseOSError, Operations
+
+
+class SlowFS(Operations):
+    def __init__(self, source, delay, probability):
+        self.source = source
+        self.delay = delay
+        self.probability = probability
+
+    def _path(self, path):
+        return os.path.join(self.source, path.lstrip('/'))
+
+    def getattr(self, path, fh=None):
+        try:
+            st = os.lstat(self._path(path))
+        except FileNotFoundError:
+            raise FuseOSError(errno.ENOENT)
+        return {key: getattr(st, key) for key in
+                ('st_mode', 'st_size', 'st_nlink', 'st_uid', 'st_gid', 'st_atime', 'st_mtime', 'st_ctime')}
+
+    def readdir(self, path, fh):
+        return ['.', '..'] + os.listdir(self._path(path))
+
+    def open(self, path, flags):
+        return os.open(self._path(path), os.O_RDONLY)
+
+    def read(self, path, size, offset, fh):
+        if 'hang' in os.path.basename(path):
+            threading.Event().wait()
+        if random.random() < self.probability:
+            time.sleep(self.delay)
+        return os.pread(fh, size, offset)
+
+    def release(self, path, fh):
+        os.close(fh)
+
+
+if __name__ == '__main__':
+    probability = float(sys.argv[4]) if len(sys.argv) > 4 else 1.0
+    FUSE(SlowFS(sys.argv[1], float(sys.argv[3]), probability), sys.argv[2], foreground=True, nothreads=False,
+         ro=True, direct_io=True)
@@ -0,0 +1,34 @@
+/**
+ * Builds the file table of a synthetic tree of a thousand files per directory and a thousand directories per top
+ * directory, and reports its size against the size of the same files as objects and chunks.
+ * Usage: table <count>
+ */
+
+#define MINIGREP_NO_MAIN
+#include "../minigrep/minigrep.cpp"
+
+int main(int argc, char** argv) {
+    const auto count = argc == 2 ? minigrep::parse_positive(argv[1]) : std::nullopt;
+    if (!count) {
+        std::cerr << "Usage: table <count>\n";
+        return EXIT_FAILURE;
+    }
+    minigrep::FileTable table(minigrep::load_tuning(minigrep::default_profile_path()).table_memory);
+    long long objects = 0;
+    for (long long i = 0; i < count.value() && !table.failed; ++i) {
+        minigrep::File file;
+        file.path = "tree/" + std::to_string(i / 1'000'000) + "/" + std::to_string(i / 1000 % 1000) + "/file" +
+                    std::to_string(i) + ".log";
+        file.size = i % 65536;
+        objects += sizeof(minigrep::File) + sizeof(minigrep::FileChunk) + file.path.capacity() + 1;
+        table.add(file);
+    }
+    if (table.failed) {
+        std::cerr << "Could not spill the file table to " << std::filesystem::temp_directory_path() << "\n";
+        return EXIT_FAILURE;
+    }
+    std::cout << "files: " << table.size() << "\n";
+    std::cout << "table: " << table.bytes() / 1e6 << " MB" << (table.spilled ? " (spilled)" : "") << "\n";
+    std::cout << "objects: " << objects / 1e6 << " MB\n";
+    std::cout << "peak rss: " << minigrep::peak_rss() / 1e6 << " MB\n";
+}
@@ -1,23 +1,81 @@
+#include <fcntl.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
-#include <future>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <queue>
+#include <random>
+#include <semaphore>
+#include <set>
+#include <sstream>
+#include <stop_token>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "probes.h"
+
 namespace minigrep {
 
 constexpr int border_size = 3;        /**< The number of characters to show for the prefix and suffix. */
-constexpr int chunk_size = 1'000'000; /**< The maximum amount of characters that a single async task can process. */
+constexpr int chunk_size = 1'000'000; /**< The default maximum amount of characters that a single task can process. */
+constexpr int engine_threshold = 16;  /**< The default needle length from which Boyer-Moore-Horspool is used. */
+constexpr int control_window = 200;   /**< The default length of a throughput measurement window in milliseconds. */
+constexpr double climb_tolerance = 0.05; /**< The relative throughput loss that is not attributed to noise. */
+constexpr int pressure_threshold = 100;  /**< The default stall percentage from which a scan backs off (never). */
+constexpr int small_file = 64 << 10;      /**< The size below which a file is always read with pread. */
+constexpr int mmap_threshold = 4 << 20;   /**< The default size from which a cached file is mapped. */
+constexpr int direct_threshold = 64 << 20; /**< The default size from which an uncached file bypasses the cache. */
+constexpr int page_size = 4096;           /**< The alignment of O_DIRECT reads and of the residency probes. */
+constexpr int index_threshold = 50;       /**< The default candidate percentage below which the index is used. */
+constexpr int index_bits = 1 << 16;       /**< The number of trigram buckets an index distinguishes. */
+constexpr int read_timeout = 30'000;      /**< The default time in milliseconds after which a read is abandoned. */
+constexpr int hedge_samples = 100;        /**< The number of reads to measure before slow ones are hedged. */
+constexpr int io_depth = 4;               /**< The default number of uncached chunks read at once. */
+constexpr int sort_memory = 256 << 20;    /**< The default memory in bytes that sorted output buffers in. */
+constexpr int sort_fanin = 64;            /**< The default number of sorted runs merged at once. */
+constexpr int table_memory = 1 << 30;     /**< The default memory in bytes the file table takes up before spilling. */
+constexpr int automaton_streams = 8;      /**< The default number of parts of a chunk a pattern set scans at once. */
+constexpr int automaton_memory = 0;       /**< The default memory of the automaton of a shard, 0 to plan it. */
+constexpr std::array<long long, 4> cache_sizes{0, 48 << 10, 2 << 20, 32 << 20}; /**< By level, where unknown. */
+constexpr int cache_load_cost = 4;        /**< The default time of a load from the last level cache, in L2 loads. */
+constexpr int memory_load_cost = 16;      /**< The default time of a load from memory, in L2 loads. */
 
 /**
  * Data structure that represents a half-open interval.
  */
 struct Range {
-    int begin; /**< Beginning of range (inclusive). */
-    int end;   /**< End of range (exclusive). */
+    long long begin; /**< Beginning of range (inclusive). */
+    long long end;   /**< End of range (exclusive). */
 
     /**
      * Clamps this range to fit inside the half-open interval [min, max).
@@ -25,7 +83,7 @@ struct Range {
      * @param max The maximum of the clamped range.
      * @return The clamped range.
      */
-    [[nodiscard]] constexpr Range clamp(int min, int max) const {
+    [[nodiscard]] constexpr Range clamp(long long min, long long max) const {
         return Range{std::max(begin, min), std::min(end, max)};
     }
 
@@ -34,22 +92,23 @@ struct Range {
      * @param amount The amount to extend the range by.
      * @return The extended range.
      */
-    [[nodiscard]] constexpr Range extend(int amount) const { return Range{begin - amount, end + amount}; }
+    [[nodiscard]] constexpr Range extend(long long amount) const { return Range{begin - amount, end + amount}; }
 
     /**
      * Size of this range.
      * @return The size of this range.
      */
-    [[nodiscard]] constexpr int size() const { return end - begin; }
+    [[nodiscard]] constexpr long long size() const { return end - begin; }
 
     /**
      * Splits this chunk into two smaller chunks if it is large enough.
+     * @param max_size The maximum size of a chunk.
      * @return The two smaller chunks, or std::nullopt the chunk is small enough.
      */
-    [[nodiscard]] constexpr std::optional<std::pair<Range, Range>> split() const {
-        if (size() <= chunk_size)
+    [[nodiscard]] constexpr std::optional<std::pair<Range, Range>> split(long long max_size) const {
+        if (size() <= max_size)
             return std::nullopt;
-        int mid = begin + chunk_size;
+        long long mid = begin + max_size;
         return std::make_pair(Range{begin, mid}, Range{mid, end});
     }
 };
@@ -62,21 +121,523 @@ struct Range {
  */
 [[nodiscard]] constexpr bool operator==(const Range& l, const Range& r) { return l.begin == r.begin && l.end == r.end; }
 
+/**
+ * The number of workers to use when no profile says otherwise.
+ * @return The number of hardware threads, or 1 if it cannot be determined.
+ */
+[[nodiscard]] int default_workers() { return std::max(1, static_cast<int>(std::thread::hardware_concurrency())); }
+
+/**
+ * The size of a level of the data cache of the processor.
+ * @param level The level, 1 to 3.
+ * @return The size in bytes, or a typical one if it cannot be determined.
+ */
+[[nodiscard]] long long cache_size(int level) {
+    const long size = ::sysconf(level == 1 ? _SC_LEVEL1_DCACHE_SIZE : level == 2 ? _SC_LEVEL2_CACHE_SIZE
+                                                                                 : _SC_LEVEL3_CACHE_SIZE);
+    return size > 0 ? size : cache_sizes[level];
+}
+
+/**
+ * The sizes of the levels of the data cache of the processor.
+ * @return The size in bytes of every level, by level.
+ */
+[[nodiscard]] std::array<long long, 4> cache_sizes_now() { return {0, cache_size(1), cache_size(2), cache_size(3)}; }
+
+/**
+ * The kinds of filesystems that are read differently.
+ */
+enum class Filesystem { other, tmpfs, ext4, xfs, btrfs, nfs, cifs, fuse };
+
+constexpr std::array<std::string_view, 8> filesystem_names{"other", "tmpfs", "ext4", "xfs",
+                                                           "btrfs", "nfs",   "cifs", "fuse"}; /**< By Filesystem. */
+
+/**
+ * Determines the kind of filesystem.
+ * @param magic The f_type reported by statfs.
+ * @return The kind of filesystem.
+ */
+[[nodiscard]] constexpr Filesystem filesystem(unsigned long magic) {
+    switch (magic) {
+    case 0x01021994:
+        return Filesystem::tmpfs;
+    case 0xef53: // ext2, ext3 and ext4 share the magic
+        return Filesystem::ext4;
+    case 0x58465342:
+        return Filesystem::xfs;
+    case 0x9123683e:
+        return Filesystem::btrfs;
+    case 0x6969:
+        return Filesystem::nfs;
+    case 0xff534d42:
+    case 0xfe534d42: // smb2
+        return Filesystem::cifs;
+    case 0x65735546:
+        return Filesystem::fuse;
+    default:
+        return Filesystem::other;
+    }
+}
+
+/**
+ * Whether a filesystem is served over the network or by a user space process.
+ * @param filesystem The kind of filesystem.
+ * @return Whether reads may take arbitrarily long.
+ */
+[[nodiscard]] constexpr bool remote(Filesystem filesystem) {
+    return filesystem == Filesystem::nfs || filesystem == Filesystem::cifs || filesystem == Filesystem::fuse;
+}
+
+/**
+ * How a kind of filesystem is read.
+ */
+struct IoProfile {
+    int read_size;   /**< The size of the chunks read at once, 0 for the tuned chunk size. */
+    int queue_depth; /**< The maximum number of reads in flight on the filesystem. */
+    int readahead;   /**< The number of bytes past a chunk to prefetch, 0 for none. */
+};
+
+/**
+ * The default profiles, indexed by Filesystem. Memory is read in cache sized chunks without a queue, network
+ * filesystems in few large reads with deep queues and prefetching, and FUSE daemons get a shallow queue as they tend
+ * to serve requests one at a time.
+ */
+constexpr std::array<IoProfile, filesystem_names.size()> io_profiles{{
+    {0, 64, 0},                  // other
+    {256 << 10, 1 << 10, 0},     // tmpfs
+    {0, 64, 2 << 20},            // ext4
+    {0, 64, 2 << 20},            // xfs
+    {0, 64, 2 << 20},            // btrfs
+    {8 << 20, 128, 16 << 20},    // nfs
+    {8 << 20, 128, 16 << 20},    // cifs
+    {1 << 20, 8, 0},             // fuse
+}};
+
+/**
+ * The keys of the per filesystem entries of a profile, which are prefixed by the name of the filesystem.
+ */
+constexpr std::array<std::pair<std::string_view, int IoProfile::*>, 3> io_profile_keys{{
+    {"read_size", &IoProfile::read_size},
+    {"queue_depth", &IoProfile::queue_depth},
+    {"readahead", &IoProfile::readahead},
+}};
+
+/**
+ * Machine specific parameters, usually loaded from a profile written by `minigrep calibrate`.
+ */
+struct Tuning {
+    int chunk_size = minigrep::chunk_size;                 /**< The maximum amount of characters a task processes. */
+    int workers = default_workers();                       /**< The number of active workers a scan starts with. */
+    int max_workers = 4 * default_workers();               /**< The climbing limit, #workers pins the count. */
+    int control_window = minigrep::control_window;         /**< The throughput window in milliseconds. */
+    int engine_threshold = minigrep::engine_threshold;     /**< The needle length from which BMH is used. */
+    int pressure_threshold = minigrep::pressure_threshold; /**< The stall percentage to back off from, 100 never. */
+    int mmap_threshold = minigrep::mmap_threshold;         /**< The size from which a cached file is mapped. */
+    int direct_threshold = minigrep::direct_threshold;     /**< The size from which a cold file uses O_DIRECT. */
+    int index_threshold = minigrep::index_threshold;       /**< The candidate percentage to use the index below. */
+    int read_timeout = minigrep::read_timeout;             /**< The time in milliseconds to abandon a read after. */
+    int io_depth = minigrep::io_depth;                     /**< The number of uncached chunks read at once. */
+    int sort_memory = minigrep::sort_memory;               /**< The memory sorted output buffers in. */
+    int sort_fanin = minigrep::sort_fanin;                 /**< The number of sorted runs merged at once. */
+    int table_memory = minigrep::table_memory;             /**< The memory the file table takes up before spilling. */
+    int automaton_streams = minigrep::automaton_streams;   /**< The parts of a chunk a pattern set scans at once. */
+    int automaton_memory = minigrep::automaton_memory;     /**< The memory of the automaton of a shard, 0 planned. */
+    int cache_load_cost = minigrep::cache_load_cost;       /**< The time of a last level cache load, in L2 loads. */
+    int memory_load_cost = minigrep::memory_load_cost;     /**< The time of a load from memory, in L2 loads. */
+    std::array<IoProfile, filesystem_names.size()> filesystems = io_profiles; /**< Indexed by Filesystem. */
+    std::set<std::string, std::less<>> tuned; /**< The keys whose values were taken from a profile. */
+
+    /**
+     * How a kind of filesystem is read.
+     * @param filesystem The kind of filesystem.
+     * @return The profile of the filesystem, with the tuned chunk size filled in.
+     */
+    [[nodiscard]] IoProfile io_profile(Filesystem filesystem) const {
+        IoProfile result = filesystems[static_cast<int>(filesystem)];
+        result.read_size = result.read_size ? result.read_size : chunk_size;
+        result.queue_depth = std::max(result.queue_depth, 1);
+        return result;
+    }
+};
+
+/**
+ * The keys of a profile and the tuning values they correspond to.
+ */
+constexpr std::array<std::pair<std::string_view, int Tuning::*>, 18> tuning_keys{{
+    {"chunk_size", &Tuning::chunk_size},
+    {"workers", &Tuning::workers},
+    {"max_workers", &Tuning::max_workers},
+    {"control_window", &Tuning::control_window},
+    {"engine_threshold", &Tuning::engine_threshold},
+    {"pressure_threshold", &Tuning::pressure_threshold},
+    {"mmap_threshold", &Tuning::mmap_threshold},
+    {"direct_threshold", &Tuning::direct_threshold},
+    {"index_threshold", &Tuning::index_threshold},
+    {"read_timeout", &Tuning::read_timeout},
+    {"io_depth", &Tuning::io_depth},
+    {"sort_memory", &Tuning::sort_memory},
+    {"sort_fanin", &Tuning::sort_fanin},
+    {"table_memory", &Tuning::table_memory},
+    {"automaton_streams", &Tuning::automaton_streams},
+    {"automaton_memory", &Tuning::automaton_memory},
+    {"cache_load_cost", &Tuning::cache_load_cost},
+    {"memory_load_cost", &Tuning::memory_load_cost},
+}};
+
+/**
+ * The location of the profile when none is given on the command line.
+ * @return $MINIGREP_PROFILE, or the profile in the user's configuration directory.
+ */
+[[nodiscard]] std::filesystem::path default_profile_path() {
+    if (const char* path = std::getenv("MINIGREP_PROFILE"))
+        return path;
+    if (const char* config = std::getenv("XDG_CONFIG_HOME"))
+        return std::filesystem::path(config) / "minigrep" / "profile";
+    if (const char* home = std::getenv("HOME"))
+        return std::filesystem::path(home) / ".config" / "minigrep" / "profile";
+    return "minigrep.profile";
+}
+
+/**
+ * Parses a non-negative integer.
+ * @param string The text to parse.
+ * @return The integer, or std::nullopt if the text is not a non-negative integer.
+ */
+[[nodiscard]] constexpr std::optional<int> parse_natural(std::string_view string) {
+    if (string.empty()) // std::from_chars is not constexpr yet
+        return std::nullopt;
+    long long value = 0;
+    for (const auto& c : string) {
+        if (c < '0' || c > '9' || (value = value * 10 + (c - '0')) > std::numeric_limits<int>::max())
+            return std::nullopt;
+    }
+    return static_cast<int>(value);
+}
+
+/**
+ * Parses a positive integer.
+ * @param string The text to parse.
+ * @return The integer, or std::nullopt if the text is not a positive integer.
+ */
+[[nodiscard]] constexpr std::optional<int> parse_positive(std::string_view string) {
+    const auto value = parse_natural(string);
+    return value > 0 ? value : std::nullopt;
+}
+
+/**
+ * Finds the value a key of a profile refers to.
+ * @param tuning The tuning.
+ * @param key A key such as "workers" or "nfs.read_size".
+ * @return The value, or nullptr if there is no such key.
+ */
+template <typename T> [[nodiscard]] auto tuning_value(T& tuning, std::string_view key) -> decltype(&tuning.chunk_size) {
+    for (const auto& [name, value] : tuning_keys)
+        if (name == key)
+            return &(tuning.*value);
+    for (std::size_t i = 0; i < filesystem_names.size(); ++i)
+        for (const auto& [name, value] : io_profile_keys)
+            if (key.size() == filesystem_names[i].size() + 1 + name.size() && key.starts_with(filesystem_names[i]) &&
+                key[filesystem_names[i].size()] == '.' && key.ends_with(name))
+                return &(tuning.filesystems[i].*value);
+    return nullptr;
+}
+
+/**
+ * Parses a duration such as 5s, 500ms or 2m, a plain number being seconds.
+ * @param string The text to parse.
+ * @return The duration in milliseconds, or std::nullopt if the text is not a positive duration.
+ */
+[[nodiscard]] constexpr std::optional<int> parse_duration(std::string_view string) {
+    constexpr std::array<std::pair<std::string_view, int>, 3> units{{{"ms", 1}, {"s", 1000}, {"m", 60'000}}};
+    for (const auto& [unit, scale] : units) {
+        if (!string.ends_with(unit))
+            continue;
+        const auto value = parse_positive(string.substr(0, string.size() - unit.size()));
+        if (!value || value.value() > std::numeric_limits<int>::max() / scale)
+            return std::nullopt;
+        return value.value() * scale;
+    }
+    const auto value = parse_positive(string);
+    return value && value.value() <= std::numeric_limits<int>::max() / 1000 ? std::optional(value.value() * 1000)
+                                                                            : std::nullopt;
+}
+
+/**
+ * Loads the tuning from a profile, a missing profile leaves every value at its default.
+ * @param path Path of the profile.
+ * @return The tuning.
+ */
+[[nodiscard]] Tuning load_tuning(const std::filesystem::path& path) {
+    Tuning tuning;
+    std::ifstream is(path);
+    for (std::string line; std::getline(is, line);) {
+        if (line.empty() || line.front() == '#')
+            continue;
+        const auto separator = line.find('=');
+        const std::string_view key = std::string_view(line).substr(0, separator);
+        int* entry = tuning_value(tuning, key);
+        // only the per filesystem values can be 0, meaning the tuned chunk size or no prefetching
+        const auto value = separator == std::string::npos ? std::nullopt
+                           : key.find('.') == std::string_view::npos
+                               ? parse_positive(std::string_view(line).substr(separator + 1))
+                               : parse_natural(std::string_view(line).substr(separator + 1));
+        if (!entry || !value) {
+            std::cerr << "Ignoring line '" << line << "' in profile " << path << "\n";
+            continue;
+        }
+        *entry = value.value();
+        tuning.tuned.emplace(key);
+    }
+    return tuning;
+}
+
+/**
+ * Saves the tuned values of a tuning to a profile, creating its directory if needed; the others keep their defaults.
+ * @param path Path of the profile.
+ * @param tuning The tuning to save.
+ * @return Whether the profile was written.
+ */
+[[nodiscard]] bool save_tuning(const std::filesystem::path& path, const Tuning& tuning) {
+    std::error_code error;
+    if (path.has_parent_path())
+        std::filesystem::create_directories(path.parent_path(), error);
+    std::ofstream os(path);
+    os << "# minigrep tuning profile, written by `minigrep calibrate`\n";
+    for (const auto& [key, value] : tuning_keys)
+        if (tuning.tuned.contains(key))
+            os << key << "=" << tuning.*value << "\n";
+    for (const auto& key : tuning.tuned) // per filesystem overrides are kept, they are not calibrated
+        if (key.find('.') != std::string::npos)
+            os << key << "=" << *tuning_value(tuning, key) << "\n";
+    return static_cast<bool>(os);
+}
+
+/**
+ * The ways a chunk can be read.
+ */
+enum class IoMethod { stream, pread, mmap, direct };
+
+constexpr std::array<std::string_view, 4> io_names{"stream", "pread", "mmap", "direct"}; /**< Indexed by IoMethod. */
+
+/**
+ * Parses the name of an I/O method.
+ * @param name The name.
+ * @return The I/O method, or std::nullopt if there is none by that name.
+ */
+[[nodiscard]] constexpr std::optional<IoMethod> parse_io(std::string_view name) {
+    for (std::size_t i = 0; i < io_names.size(); ++i)
+        if (io_names[i] == name)
+            return static_cast<IoMethod>(i);
+    return std::nullopt;
+}
+
+/**
+ * What the cost model knows about a file.
+ */
+struct IoFacts {
+    long long size;        /**< The size of the file. */
+    Filesystem filesystem; /**< The filesystem the file lives on. */
+    bool rotational;       /**< Whether the file lives on a rotational disk. */
+    double resident;       /**< The fraction of the file that is in the page cache. */
+};
+
+/**
+ * Picks the cheapest way to read a file. Small files take a single pread, cached large files are mapped to save the
+ * copy, and uncached large files on solid state storage bypass the cache so that a one-shot sweep does not evict the
+ * working set. Remote filesystems are never mapped or read directly, as both behave badly when the server stalls.
+ * @param facts What is known about the file.
+ * @param mmap_threshold The size from which a cached file is mapped.
+ * @param direct_threshold The size from which an uncached file bypasses the cache.
+ * @return The I/O method.
+ */
+[[nodiscard]] constexpr IoMethod choose_io(const IoFacts& facts, int mmap_threshold, int direct_threshold) {
+    if (facts.size < small_file || remote(facts.filesystem))
+        return IoMethod::pread;
+    if (facts.resident >= 0.5 && facts.size >= mmap_threshold)
+        return IoMethod::mmap;
+    if (facts.resident < 0.05 && facts.size >= direct_threshold && !facts.rotational &&
+        facts.filesystem != Filesystem::tmpfs)
+        return IoMethod::direct;
+    return IoMethod::pread;
+}
+
+/**
+ * Looks up the filesystem and the kind of disk behind a device, caching the answer.
+ * @param device The device the file lives on.
+ * @param path Path of a file on the device.
+ * @return The kind of filesystem and whether the disk is rotational.
+ */
+[[nodiscard]] std::pair<Filesystem, bool> device_facts(dev_t device, const std::string& path) {
+    static std::mutex mutex;
+    static std::map<dev_t, std::pair<Filesystem, bool>> cache;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (const auto it = cache.find(device); it != cache.end())
+        return it->second;
+    struct statfs fs{};
+    const Filesystem kind = ::statfs(path.c_str(), &fs) == 0 ? filesystem(fs.f_type) : Filesystem::other;
+    // partitions keep their queue attributes in the parent device
+    const auto block = "/sys/dev/block/" + std::to_string(major(device)) + ":" + std::to_string(minor(device));
+    char rotational = '0';
+    if (!(std::ifstream(block + "/queue/rotational") >> rotational))
+        std::ifstream(block + "/../queue/rotational") >> rotational;
+    return cache[device] = {kind, rotational == '1'};
+}
+
+/**
+ * Asks the page cache which pages of a file it holds, mapping the file once for mincore.
+ * @param path Path of the file.
+ * @param size Size of the file.
+ * @return Whether each page is resident, none if the file could not be mapped.
+ */
+[[nodiscard]] std::vector<bool> resident_pages(const std::string& path, long long size) {
+    const int fd = size > 0 ? ::open(path.c_str(), O_RDONLY) : -1;
+    if (fd < 0)
+        return {};
+    void* map = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+        return {};
+    std::vector<unsigned char> vec((size + page_size - 1) / page_size);
+    std::vector<bool> result;
+    if (::mincore(map, size, vec.data()) == 0)
+        for (const unsigned char c : vec)
+            result.push_back(c & 1);
+    ::munmap(map, size);
+    return result;
+}
+
+/**
+ * The fraction of the pages of a file that are in the page cache.
+ * @param pages Whether each page is resident.
+ * @return The fraction, 0 if nothing is known.
+ */
+[[nodiscard]] constexpr double resident_fraction(const std::vector<bool>& pages) {
+    return pages.empty() ? 0 : static_cast<double>(std::count(pages.begin(), pages.end(), true)) / pages.size();
+}
+
+/**
+ * The modification time of a file.
+ * @param st The status of the file.
+ * @return The modification time in nanoseconds.
+ */
+[[nodiscard]] long long mtime(const struct stat& st) {
+    return st.st_mtim.tv_sec * 1'000'000'000LL + st.st_mtim.tv_nsec;
+}
+
 /**
  * A file on disk.
  */
 struct File {
-    std::string path; /**< The path to the file. */
-    int size;         /**< The size of the file. */
+    std::string path;                          /**< The path to the file. */
+    long long size = 0;                        /**< The size of the file. */
+    long long mtime = 0;                       /**< The modification time in nanoseconds. */
+    unsigned long long inode = 0;              /**< The inode number, which changes when a log is rotated. */
+    Filesystem filesystem = Filesystem::other; /**< The filesystem the file lives on. */
+    bool rotational = false;                   /**< Whether the file lives on a rotational disk. */
+    IoMethod io = IoMethod::pread;             /**< How the file is read. */
+    std::shared_ptr<const std::vector<bool>> resident; /**< The pages in the page cache, once probed. */
+
+    /**
+     * Constructs a file whose fields are filled in by the caller.
+     */
+    File() = default;
 
     /**
      * Constructs a file using the specified path to determine the size.
      * @param path Path of the file.
      */
     File(std::string_view path) : path(path) {
-        std::ifstream is(this->path);
-        is.seekg(0, is.end);
-        size = is.tellg();
+        struct stat st{};
+        if (::stat(this->path.c_str(), &st) != 0)
+            return;
+        size = st.st_size;
+        mtime = minigrep::mtime(st);
+        inode = st.st_ino;
+        std::tie(filesystem, rotational) = device_facts(st.st_dev, this->path);
+    }
+
+    /**
+     * Probes which pages of the file are in the page cache, the first time only. Small files are not probed, as they
+     * take a single pread anyway, nor are remote ones, as opening them costs a round trip and their queue depth
+     * throttles them already.
+     * @return Whether each page is resident, none if the file was not probed.
+     */
+    const std::vector<bool>& probe_residency() {
+        if (!resident)
+            resident = std::make_shared<const std::vector<bool>>(
+                size < small_file || remote(filesystem) ? std::vector<bool>{} : resident_pages(path, size));
+        return *resident;
+    }
+
+    /**
+     * Chooses how the file is read using the cost model, which probes the page cache.
+     * @param tuning The thresholds of the cost model.
+     */
+    void choose_io(const Tuning& tuning) {
+        io = minigrep::choose_io(IoFacts{size, filesystem, rotational, resident_fraction(probe_residency())},
+                                 tuning.mmap_threshold, tuning.direct_threshold);
+    }
+};
+
+/**
+ * The file mappings whose contents are being searched. A file truncated while it is mapped, as a rotated log may be,
+ * raises SIGBUS on the pages past its new end; the handler maps zeros over such a page of a registered mapping, so
+ * that the search reads zeros where the file ended instead of the process dying.
+ */
+struct Mappings {
+    static constexpr std::size_t capacity = 1024; /**< The number of mappings that can be registered at once. */
+
+    static inline std::array<std::atomic<std::uintptr_t>, capacity> begins{}; /**< The start of each, 0 if free. */
+    static inline std::array<std::atomic<std::uintptr_t>, capacity> ends{};   /**< The end of each, 0 if not ready. */
+
+    /**
+     * Registers a mapping, installing the handler first.
+     * @param begin The start of the mapping.
+     * @param length The length of the mapping.
+     * @return The slot of the mapping, or std::nullopt if every slot is taken.
+     */
+    [[nodiscard]] static std::optional<std::size_t> add(const char* begin, std::size_t length) {
+        [[maybe_unused]] static const bool installed = [] {
+            struct sigaction action{};
+            action.sa_sigaction = handle;
+            action.sa_flags = SA_SIGINFO;
+            ::sigemptyset(&action.sa_mask);
+            return ::sigaction(SIGBUS, &action, nullptr) == 0;
+        }();
+        const auto address = reinterpret_cast<std::uintptr_t>(begin);
+        for (std::size_t slot = 0; slot < capacity; ++slot)
+            if (std::uintptr_t free = 0; begins[slot].compare_exchange_strong(free, address)) {
+                ends[slot] = address + length;
+                return slot;
+            }
+        return std::nullopt;
+    }
+
+    /**
+     * Unregisters a mapping, before it is unmapped.
+     * @param slot The slot of the mapping.
+     */
+    static void remove(std::size_t slot) {
+        ends[slot] = 0;
+        begins[slot] = 0;
+    }
+
+  private:
+    /**
+     * Maps a page of zeros over the faulting page of a registered mapping, and dies of any other SIGBUS.
+     * @param info Where the fault happened.
+     */
+    static void handle(int, siginfo_t* info, void*) {
+        const auto address = reinterpret_cast<std::uintptr_t>(info->si_addr);
+        for (std::size_t slot = 0; slot < capacity; ++slot) {
+            if (address < begins[slot] || address >= ends[slot])
+                continue;
+            void* page = reinterpret_cast<void*>(address / page_size * page_size);
+            if (::mmap(page, page_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED)
+                return;
+        }
+        ::signal(SIGBUS, SIG_DFL);
+        ::raise(SIGBUS);
     }
 };
 
@@ -87,25 +648,124 @@ struct FileChunk {
     File file;    /**< The file to be searched. */
     Range search; /**< The range to be searched. */
     Range read;   /**< The range that has to be read (this may be larger to properly output the prefix/suffix). */
-    std::string contents; /**< The contents corresponding to the read range. */
+    std::string_view contents;          /**< The contents corresponding to the read range. */
+    std::shared_ptr<const char> memory; /**< The buffer or mapping that #contents points into. */
+    bool cold = false;                  /**< Whether part of the read range was missing from the page cache. */
+    std::size_t sequence = 0;           /**< The position of the chunk in the output. */
+    std::chrono::nanoseconds fetch_time{}; /**< The time the read took, if measured. */
+    std::chrono::nanoseconds fetch_cpu{};  /**< The CPU time the reading thread spent on it, if measured. */
 
     /**
      * Constructs a chunk.
      * @param file The file to be searched.
      * @param search The range to be searched.
+     * @param needle_size The length of the searched string, matches starting in the search range may end past it.
+     */
+    FileChunk(const File& file, const Range& search, int needle_size)
+        : file(file), search(search),
+          read(Range{search.begin - border_size, search.end + std::max(needle_size - 1, 0) + border_size}.clamp(
+              0, file.size)) {}
+
+    /**
+     * Reads the corresponding segment of the file into @see #contents using the file's I/O method.
+     * O_DIRECT falls back to pread on filesystems that do not support it.
+     * @param readahead The number of bytes past the chunk to ask the kernel to prefetch.
+     */
+    void fetch_contents(int readahead = 0) {
+        if (file.io == IoMethod::stream) {
+            std::ifstream is(file.path);
+            is.seekg(read.begin);
+            auto buffer = std::make_shared<std::vector<char>>(read.size());
+            is.read(buffer->data(), buffer->size());
+            contents = std::string_view(buffer->data(), is.gcount());
+            memory = std::shared_ptr<const char>(buffer, buffer->data());
+            return;
+        }
+        int fd = ::open(file.path.c_str(), file.io == IoMethod::direct ? O_RDONLY | O_DIRECT : O_RDONLY);
+        if (fd < 0 && file.io == IoMethod::direct)
+            fd = ::open(file.path.c_str(), O_RDONLY);
+        MINIGREP_PROBE3(file_open, file.path.c_str(), fd, static_cast<int>(file.io));
+        if (fd < 0)
+            return;
+        if (file.io == IoMethod::mmap) {
+            const long long offset = read.begin % page_size, length = offset + read.size();
+            void* map = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, read.begin - offset);
+            const auto slot = map != MAP_FAILED ? Mappings::add(static_cast<char*>(map), length) : std::nullopt;
+            struct stat st{};
+            if (slot && ::fstat(fd, &st) == 0) { // the file may have shrunk since it was listed
+                ::madvise(map, length, MADV_SEQUENTIAL);
+                memory = std::shared_ptr<const char>(static_cast<char*>(map), [=](const char* p) {
+                    Mappings::remove(slot.value());
+                    ::munmap(const_cast<char*>(p), length);
+                });
+                contents = std::string_view(memory.get() + offset,
+                                            std::clamp<long long>(st.st_size - read.begin, 0, read.size()));
+            } else if (map != MAP_FAILED) { // read it instead
+                if (slot)
+                    Mappings::remove(slot.value());
+                ::munmap(map, length);
+            }
+        } else if (file.io == IoMethod::direct) {
+            const long long begin = read.begin / page_size * page_size;
+            const long long end = (read.end + page_size - 1) / page_size * page_size;
+            void* buffer = nullptr;
+            if (::posix_memalign(&buffer, page_size, end - begin) == 0) {
+                memory = std::shared_ptr<const char>(static_cast<char*>(buffer), [](const char* p) {
+                    std::free(const_cast<char*>(p));
+                });
+                const ssize_t count = pread_all(fd, static_cast<char*>(buffer), end - begin, begin);
+                if (count >= 0)
+                    contents = std::string_view(memory.get() + (read.begin - begin),
+                                                std::clamp<ssize_t>(count - (read.begin - begin), 0, read.size()));
+                else
+                    memory.reset();
+            }
+            if (!memory) { // EINVAL: the filesystem wants a different alignment
+                ::close(fd);
+                if ((fd = ::open(file.path.c_str(), O_RDONLY)) < 0)
+                    return;
+            }
+        }
+        if (!memory) {
+            auto buffer = std::make_shared<std::vector<char>>(read.size());
+            const ssize_t count = pread_all(fd, buffer->data(), read.size(), read.begin);
+            contents = std::string_view(buffer->data(), std::max<ssize_t>(count, 0));
+            memory = std::shared_ptr<const char>(buffer, buffer->data());
+        }
+        if (readahead > 0 && read.end < file.size && file.io != IoMethod::direct)
+            ::posix_fadvise(fd, read.end, readahead, POSIX_FADV_WILLNEED);
+        ::close(fd);
+    }
+
+    /**
+     * Releases the memory holding the contents.
      */
-    FileChunk(const File& file, const Range& search)
-        : file(file), search(search), read(search.extend(border_size).clamp(0, file.size)) {}
+    void release() {
+        contents = {};
+        memory.reset();
+    }
 
     /**
-     * Reads the corresponding segment of the file into @see #contents.
+     * Reads until the count is satisfied, the end of the file is reached or an error occurs.
+     * @param fd The file descriptor.
+     * @param buffer The buffer to read into.
+     * @param count The number of bytes to read.
+     * @param offset The offset in the file.
+     * @return The number of bytes read, or -1 on error.
      */
-    void fetch_contents() {
-        std::ifstream is(file.path);
-        is.seekg(read.begin);
-        std::vector<char> buffer(read.size());
-        is.read(buffer.data(), buffer.size());
-        contents = std::string(buffer.begin(), buffer.end());
+    static ssize_t pread_all(int fd, char* buffer, std::size_t count, off_t offset) {
+        std::size_t done = 0;
+        while (done < count) {
+            const ssize_t n = ::pread(fd, buffer + done, count - done, offset + done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                return -1;
+            if (n == 0)
+                break;
+            done += n;
+        }
+        return done;
     }
 };
 
@@ -114,7 +774,7 @@ struct FileChunk {
  */
 struct Match {
     std::string path;   /**< The path to the file in which the match occurred. */
-    int position;       /**< The offset of the match from the start of the file. */
+    long long position; /**< The offset of the match from the start of the file. */
     std::string prefix; /**< The characters before the match. */
     std::string suffix; /**< The characters after the match. */
 };
@@ -175,107 +835,3983 @@ transform(std::string_view string) { // constexpr std::string still being added
 }
 
 /**
- * Finds all the occurrences of a string in the portion of a file.
- * @param chunk The portion of a file to be searched.
- * @param string The string to search for.
- * @return All the matches.
+ * An Aho-Corasick automaton that finds every occurrence of a set of patterns in a single pass, as a dense table of the
+ * transitions of every state on every class of bytes, the bytes in no pattern forming one class.
+ * The table of a large pattern set is far larger than the caches, and as every transition depends on the one before,
+ * a scan would wait for memory on every byte. The text is therefore cut into parts that are scanned in lockstep, so
+ * that the loads of all parts are in flight at once.
  */
-[[nodiscard]] std::vector<Match> matches(const FileChunk& chunk, std::string_view string) {
-    std::vector<Match> result;
-    auto to_index = [&](int pos) { return pos - chunk.read.begin; };
-    for (std::size_t pos = chunk.contents.find(string, to_index(chunk.search.begin));
-         pos != std::string::npos && pos < to_index(chunk.search.end); pos = chunk.contents.find(string, pos + 1)) {
-        result.push_back(Match{chunk.file.path, static_cast<int>(pos), transform(prefix(chunk.contents, to_index(pos))),
-                               transform(suffix(chunk.contents, to_index(pos + string.size())))});
+struct Automaton {
+    static constexpr std::uint32_t match = 1U << 31; /**< Flags the transitions into states where patterns end. */
+    static constexpr int max_streams = 8;            /**< The most parts of a text that are scanned at once. */
+    /** The most memory an automaton may take up, which keeps the rows of #table below #match. */
+    static constexpr std::size_t max_memory = std::size_t{match} * sizeof(std::uint32_t);
+
+    std::array<std::uint16_t, 256> classes{}; /**< The class of every byte, 0 for the bytes in no pattern. */
+    std::uint32_t class_count = 1;            /**< The number of classes, the length of a row of #table. */
+    std::vector<std::uint32_t> table;         /**< The row of the next state by state row and class, with #match. */
+    std::vector<std::uint32_t> lengths;       /**< The length of the pattern that ends in every state, or 0. */
+    std::vector<std::uint32_t> dictionary;    /**< The row of the longest suffix of every state that ends a pattern. */
+    std::size_t longest = 0;                  /**< The length of the longest pattern. */
+
+    /**
+     * Builds the automaton of a set of patterns, which should take up at most max_memory as shard_patterns plans it.
+     * @param patterns The patterns, empty ones are ignored.
+     */
+    constexpr explicit Automaton(const std::vector<std::string>& patterns) {
+        for (const auto& pattern : patterns)
+            for (const unsigned char c : pattern)
+                if (!classes[c])
+                    classes[c] = class_count++;
+        table.assign(class_count, 0);
+        lengths.assign(1, 0);
+        for (const auto& pattern : patterns) {
+            std::uint32_t row = 0;
+            for (const unsigned char c : pattern) {
+                if (!table[row + classes[c]]) { // a trie edge never leads back to the root
+                    table[row + classes[c]] = static_cast<std::uint32_t>(table.size());
+                    table.resize(table.size() + class_count);
+                    lengths.push_back(0);
+                }
+                row = table[row + classes[c]];
+            }
+            if (row)
+                lengths[row / class_count] = static_cast<std::uint32_t>(pattern.size());
+            longest = std::max(longest, pattern.size());
+        }
+        // in breadth first order the rows of the failure states are complete, so missing edges are copied from them
+        dictionary.assign(lengths.size(), 0);
+        std::vector<std::uint32_t> failure(lengths.size(), 0);
+        std::vector<std::uint32_t> queue; // the rows from head on are waiting, every state passes through it once
+        std::size_t head = 0;
+        for (std::uint32_t c = 1; c < class_count; ++c)
+            if (table[c])
+                queue.push_back(table[c]);
+        while (head < queue.size()) {
+            const std::uint32_t row = queue[head++], fail = failure[row / class_count];
+            dictionary[row / class_count] = lengths[fail / class_count] ? fail : dictionary[fail / class_count];
+            for (std::uint32_t c = 0; c < class_count; ++c) {
+                if (auto& next = table[row + c]; !next) {
+                    next = table[fail + c];
+                } else {
+                    failure[next / class_count] = table[fail + c];
+                    queue.push_back(next);
+                }
+            }
+        }
+        for (auto& next : table)
+            if (lengths[next / class_count] || dictionary[next / class_count])
+                next |= match;
     }
-    return result;
-}
+
+    /**
+     * Finds the occurrences of the patterns that start in a range of a text.
+     * @param text The text, which should extend past the range by the longest pattern less one byte.
+     * @param begin The index at which the range begins.
+     * @param end The index at which the range ends.
+     * @param streams The number of parts of the range to scan at once, at most max_streams.
+     * @return The index and the length of every occurrence, ordered by index and length.
+     */
+    [[nodiscard]] constexpr std::vector<std::pair<std::size_t, std::size_t>>
+    find_all(std::string_view text, std::size_t begin, std::size_t end, int streams) const {
+        std::vector<std::pair<std::size_t, std::size_t>> result;
+        switch (std::clamp(streams, 1, max_streams)) {
+        case 1: scan<1>(text, begin, end, result); break;
+        case 2: scan<2>(text, begin, end, result); break;
+        case 3: scan<3>(text, begin, end, result); break;
+        case 4: scan<4>(text, begin, end, result); break;
+        case 5: scan<5>(text, begin, end, result); break;
+        case 6: scan<6>(text, begin, end, result); break;
+        case 7: scan<7>(text, begin, end, result); break;
+        default: scan<8>(text, begin, end, result); break;
+        }
+        std::sort(result.begin(), result.end()); // a stream finds the occurrences by their end
+        return result;
+    }
+
+    /**
+     * The memory an automaton takes up.
+     * @param states The number of states.
+     * @param classes The number of classes of bytes.
+     * @return The size in bytes.
+     */
+    [[nodiscard]] static constexpr std::size_t bytes(std::size_t states, std::size_t classes) {
+        return states * (classes + 2) * sizeof(std::uint32_t);
+    }
+
+    /**
+     * The memory the automaton takes up.
+     * @return The size in bytes.
+     */
+    [[nodiscard]] std::size_t bytes() const { return bytes(lengths.size(), class_count); }
+
+  private:
+    /**
+     * Scans parts of a range in lockstep, each starting from the root so that it only finds occurrences that start in
+     * it, and each reading past its end until no occurrence that starts in it can end later.
+     * @param text The text.
+     * @param begin The index at which the range begins.
+     * @param end The index at which the range ends.
+     * @param result The occurrences to add to.
+     */
+    template <int Streams>
+    constexpr void scan(std::string_view text, std::size_t begin, std::size_t end,
+              std::vector<std::pair<std::size_t, std::size_t>>& result) const {
+        std::array<std::size_t, Streams> position{}, limit{}, stop{};
+        std::array<std::uint32_t, Streams> row{};
+        std::size_t common = std::numeric_limits<std::size_t>::max();
+        for (int k = 0; k < Streams; ++k) {
+            position[k] = begin + (end - begin) * k / Streams;
+            limit[k] = begin + (end - begin) * (k + 1) / Streams;
+            stop[k] = limit[k] == position[k] ? position[k] : std::min(text.size(), limit[k] + longest - 1);
+            common = std::min(common, stop[k] - position[k]);
+        }
+        auto step = [&](int k) {
+            const std::uint32_t next = table[row[k] + classes[static_cast<unsigned char>(text[position[k]++])]];
+            row[k] = next & ~match;
+            if (next & match) [[unlikely]]
+                for (auto found = lengths[row[k] / class_count] ? row[k] : dictionary[row[k] / class_count]; found;
+                     found = dictionary[found / class_count])
+                    if (const auto start = position[k] - lengths[found / class_count]; start < limit[k])
+                        result.emplace_back(start, lengths[found / class_count]);
+        };
+        for (std::size_t i = 0; i < common; ++i)
+            for (int k = 0; k < Streams; ++k)
+                step(k);
+        for (int k = 0; k < Streams; ++k)
+            while (position[k] < stop[k])
+                step(k);
+    }
+};
 
 /**
- * Computes which files are to be searched.
- * @param path Path to the directory or file to be searched.
- * @return All files to be searched, or std::nullopt if the given path is not valid.
+ * The length of the common prefix of two strings.
+ * @param a The one string.
+ * @param b The other string.
+ * @return The number of leading characters they share.
  */
-[[nodiscard]] std::optional<std::vector<File>> files(std::string_view path) {
-    if (std::filesystem::is_regular_file(path))
-        return std::vector<File>{File(path)};
-
-    if (!std::filesystem::is_directory(path))
-        return std::nullopt;
+[[nodiscard]] constexpr std::size_t common_prefix(std::string_view a, std::string_view b) {
+    return std::mismatch(a.begin(), a.end(), b.begin(), b.end()).first - a.begin();
+}
 
-    std::vector<File> result;
-    for (const auto& entry : std::filesystem::recursive_directory_iterator(path))
-        if (entry.is_regular_file())
-            result.emplace_back(entry.path().string());
+/**
+ * Splits a set of patterns into shards whose automata each take up at most a given memory, unless a single pattern
+ * does. The patterns are sorted so that a shard holds patterns with common prefixes, and its trie has one state per
+ * distinct prefix: the root and the bytes of each pattern past its common prefix with the one before.
+ * @param patterns The patterns.
+ * @param memory The memory an automaton may take up, 0 for as few shards as Automaton::max_memory allows.
+ * @return The shards, none for no patterns.
+ */
+[[nodiscard]] constexpr std::vector<std::vector<std::string>> shard_patterns(std::vector<std::string> patterns,
+                                                                           std::size_t memory) {
+    std::sort(patterns.begin(), patterns.end());
+    patterns.erase(std::unique(patterns.begin(), patterns.end()), patterns.end());
+    memory = memory ? std::min(memory, Automaton::max_memory) : Automaton::max_memory;
+    std::vector<std::vector<std::string>> result;
+    std::size_t states = 0, classes = 0;
+    std::array<bool, 256> seen{};
+    auto unseen = [&](std::string_view pattern) { // the number of classes the pattern adds
+        auto counted = seen;
+        std::size_t count = 0;
+        for (const unsigned char c : pattern)
+            count += !std::exchange(counted[c], true);
+        return count;
+    };
+    for (auto& pattern : patterns) {
+        std::size_t common = result.empty() ? 0 : common_prefix(pattern, result.back().back());
+        if (result.empty() ||
+            Automaton::bytes(states + pattern.size() - common, classes + unseen(pattern)) > memory) {
+            result.emplace_back();
+            states = 1, classes = 1, common = 0, seen = {};
+        }
+        states += pattern.size() - common;
+        classes += unseen(pattern);
+        for (const unsigned char c : pattern)
+            seen[c] = true;
+        result.back().push_back(std::move(pattern));
+    }
     return result;
 }
 
 /**
- * Splits the file into chunks.
- * @param file File to be split.
- * @return Chunks that correspond to the file as a whole.
+ * The memory the automaton of a set of patterns takes up.
+ * @param patterns The patterns, sorted and without duplicates.
+ * @return The size in bytes.
  */
-[[nodiscard]] std::vector<FileChunk> chunks(const File& file) {
-    std::vector<FileChunk> result{FileChunk(file, Range{0, file.size})};
-    std::optional<std::pair<Range, Range>> split_chunks;
-    while ((split_chunks = result.back().search.split())) {
-        result.back() = FileChunk(file, split_chunks.value().first);
-        result.emplace_back(file, split_chunks.value().second);
+[[nodiscard]] constexpr std::size_t automaton_bytes(const std::vector<std::string>& patterns) {
+    std::size_t states = 1, classes = 1;
+    std::array<bool, 256> seen{};
+    for (std::size_t i = 0; i < patterns.size(); ++i) {
+        const std::string_view pattern = patterns[i];
+        states += pattern.size() - (i ? common_prefix(pattern, patterns[i - 1]) : 0);
+        for (const unsigned char c : pattern)
+            classes += !std::exchange(seen[c], true);
     }
-    return result;
+    return Automaton::bytes(states, classes);
 }
 
 /**
- * Searches the chunk for matches and prints them to stdout.
- * @param chunk Chunk to be searched.
- * @param string String to search for.
+ * The cost of a pass over a text with an automaton, relative to a pass with an automaton in L2. Every byte waits for a
+ * load from the table, and the streams overlap their loads, so a pass is slowed down by slower loads only as far as
+ * the streams cannot hide them.
+ * @param load_cost The time of a load from where the table is, in L2 loads.
+ * @param streams The number of parts of the text scanned at once.
+ * @return The cost, at least 1.
  */
-void search(FileChunk& chunk, std::string_view string) {
-    chunk.fetch_contents();
-    auto all_matches = matches(chunk, string);
-    static std::mutex mutex;
-    std::lock_guard<std::mutex> lock(mutex);
-    for (const auto& match : all_matches)
-        std::cout << match << "\n";
+[[nodiscard]] constexpr double pass_cost(int load_cost, int streams) {
+    return std::max(1.0, static_cast<double>(load_cost) / std::clamp(streams, 1, Automaton::max_streams));
 }
 
-namespace test {
+/**
+ * Plans the shards of a set of patterns from the cache sizes and the load costs. Shards that fit in half of L2 each
+ * take a pass over every block of a chunk, while the fewest automata the patterns fit in each take a pass that waits
+ * on the cache level their table fits in half of, or on memory; the plan whose passes cost less wins. As the streams
+ * hide most of the latency of the larger tables, sharding pays off with few streams and slow memory.
+ * @param patterns The patterns.
+ * @param streams The number of parts of a chunk an automaton scans at once.
+ * @param caches The sizes in bytes of the levels of the data cache, by level.
+ * @param cache_load_cost The time of a load from the last level cache, in L2 loads.
+ * @param memory_load_cost The time of a load from memory, in L2 loads.
+ * @return The shards.
+ */
+[[nodiscard]] constexpr std::vector<std::vector<std::string>> plan_shards(const std::vector<std::string>& patterns,
+                                                                          int streams,
+                                                                          const std::array<long long, 4>& caches,
+                                                                          int cache_load_cost, int memory_load_cost) {
+    auto fewest = shard_patterns(patterns, 0);
+    auto shards = shard_patterns(patterns, static_cast<std::size_t>(caches[2] / 2));
+    if (shards.size() <= fewest.size())
+        return shards;
+    double fewest_cost = 0;
+    for (const auto& shard : fewest) {
+        const std::size_t bytes = automaton_bytes(shard);
+        fewest_cost += bytes <= static_cast<std::size_t>(caches[2] / 2)   ? 1
+                       : bytes <= static_cast<std::size_t>(caches[3] / 2) ? pass_cost(cache_load_cost, streams)
+                                                                          : pass_cost(memory_load_cost, streams);
+    }
+    return static_cast<double>(shards.size()) < fewest_cost ? shards : fewest;
+}
 
-static_assert(Range{1, 3}.clamp(0, 2) == Range{1, 2});
-static_assert(Range{1, 3}.extend(2) == Range{-1, 5});
-static_assert(Range{1, 3}.size() == 2);
-static_assert(Range{0, chunk_size + 100}.split().value() ==
-              std::make_pair(Range{0, chunk_size}, Range{chunk_size, chunk_size + 100}));
-static_assert(prefix("abcd", 0) == "");
-static_assert(prefix("abcd", 2) == "ab");
-static_assert(suffix("abcd", 0) == "abc");
-static_assert(suffix("abcd", 2) == "cd");
-// static_assert(transform("abcd") == "abcd");
-// static_assert(transform("\t\n") == "\\t\\n");
+/**
+ * The search string, or the set of patterns, together with the engine used to find it.
+ */
+struct Searcher {
+    using BoyerMooreHorspool = std::boyer_moore_horspool_searcher<std::string::const_iterator>;
 
-} // namespace test
+    std::string needle;                    /**< The string to search for, or the longest pattern of a set. */
+    std::optional<BoyerMooreHorspool> bmh; /**< The Boyer-Moore-Horspool tables, if that engine was chosen. */
+    std::vector<Automaton> automata;       /**< The automata of the shards of the set of patterns searched for. */
+    int streams = 1;                       /**< The number of parts of a chunk an automaton scans at once. */
+    std::size_t block = 0;                 /**< The bytes of a chunk all shards scan in turn, kept in the cache. */
 
-} // namespace minigrep
+    /**
+     * Constructs a searcher, long needles are searched for using Boyer-Moore-Horspool.
+     * @param needle The string to search for.
+     * @param engine_threshold The needle length from which Boyer-Moore-Horspool is used.
+     */
+    Searcher(std::string_view needle, int engine_threshold) : needle(needle) {
+        if (static_cast<int>(this->needle.size()) >= engine_threshold)
+            bmh.emplace(this->needle.begin(), this->needle.end());
+    }
 
-int main(int argc, char** argv) {
-    if (argc != 3) {
-        std::cerr << "Usage: minigrep <directory|file> <search string>\n";
-        return EXIT_FAILURE;
+    /**
+     * Constructs a searcher for every occurrence of a set of patterns.
+     * @param shards The patterns to search for, at least one, by the shard whose automaton is to find them.
+     * @param streams The number of parts of a chunk to scan at once.
+     * @param block The bytes of a chunk all shards scan in turn.
+     */
+    Searcher(const std::vector<std::vector<std::string>>& shards, int streams, std::size_t block)
+        : streams(streams), block(std::max<std::size_t>(block, 1)) {
+        for (const auto& shard : shards) {
+            automata.emplace_back(shard);
+            for (const auto& pattern : shard)
+                if (pattern.size() > needle.size())
+                    needle = pattern;
+        }
     }
 
-    const auto files = minigrep::files(argv[1]);
-    if (!files) {
-        std::cerr << "Argument 1 must be a directory or a file\n";
-        return EXIT_FAILURE;
+    Searcher(const Searcher&) = delete; // bmh refers to needle
+    Searcher& operator=(const Searcher&) = delete;
+
+    /**
+     * Finds the next occurrence of the needle, when searching for a single one.
+     * @param haystack The text to search.
+     * @param pos The index to start searching from.
+     * @return The index of the occurrence, or std::string::npos if there is none.
+     */
+    [[nodiscard]] std::size_t find(std::string_view haystack, std::size_t pos) const {
+        if (!bmh)
+            return haystack.find(needle, pos);
+        if (pos > haystack.size())
+            return std::string::npos;
+        const auto match = std::search(haystack.begin() + pos, haystack.end(), *bmh);
+        return match == haystack.end() ? std::string::npos : match - haystack.begin();
     }
 
-    std::vector<minigrep::FileChunk> all_chunks;
-    for (const auto& file : files.value()) {
-        const auto chunks = minigrep::chunks(file);
-        all_chunks.insert(all_chunks.end(), chunks.begin(), chunks.end());
+    /**
+     * The name of the engine in use.
+     * @return The name of the engine.
+     */
+    [[nodiscard]] std::string_view engine() const {
+        return !automata.empty() ? "aho-corasick" : bmh ? "boyer-moore-horspool" : "find";
     }
+};
+
+/**
+ * Finds all the occurrences of a string in the portion of a file.
+ * @param chunk The portion of a file to be searched.
+ * @param searcher The string to search for.
+ * @return All the matches.
+ */
+[[nodiscard]] std::vector<Match> matches(const FileChunk& chunk, const Searcher& searcher) {
+    std::vector<Match> result;
+    auto to_index = [&](long long pos) { return static_cast<std::size_t>(pos - chunk.read.begin); };
+    const std::string_view contents = chunk.contents;
+    auto add = [&](std::size_t pos, std::size_t length) {
+        MINIGREP_PROBE2(match, chunk.file.path.c_str(), chunk.read.begin + static_cast<long long>(pos));
+        result.push_back(Match{chunk.file.path, chunk.read.begin + static_cast<long long>(pos),
+                               transform(prefix(contents, pos)), transform(suffix(contents, pos + length))});
+    };
+    if (!searcher.automata.empty()) { // every shard scans a block while it is in the cache before the next block
+        const std::size_t end = std::min(to_index(chunk.search.end), contents.size());
+        const std::size_t block = searcher.automata.size() > 1 ? searcher.block : contents.size() + 1;
+        std::vector<std::pair<std::size_t, std::size_t>> found;
+        for (std::size_t from = std::min(to_index(chunk.search.begin), end); from < end; from += block)
+            for (const auto& automaton : searcher.automata) {
+                const auto part = automaton.find_all(contents, from, std::min(end, from + block), searcher.streams);
+                found.insert(found.end(), part.begin(), part.end());
+            }
+        if (searcher.automata.size() > 1)
+            std::sort(found.begin(), found.end());
+        for (const auto& [pos, length] : found)
+            add(pos, length);
+        return result;
+    }
+    for (std::size_t pos = searcher.find(contents, to_index(chunk.search.begin));
+         pos != std::string::npos && pos < to_index(chunk.search.end); pos = searcher.find(contents, pos + 1))
+        add(pos, searcher.needle.size());
+    return result;
+}
+
+/**
+ * Hands each file to be searched to a function as soon as the traversal finds it.
+ * @param path Path to the directory or file to be searched.
+ * @param visit The function to call with every file, returning false to stop the traversal.
+ * @return Whether the given path is valid.
+ */
+bool visit_files(std::string_view path, const std::function<bool(File)>& visit) {
+    if (std::filesystem::is_regular_file(path)) {
+        visit(File(path));
+        return true;
+    }
+    if (!std::filesystem::is_directory(path))
+        return false;
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(path))
+        if (entry.is_regular_file() && !visit(File(entry.path().string())))
+            break;
+    return true;
+}
+
+/**
+ * Computes which files are to be searched.
+ * @param path Path to the directory or file to be searched.
+ * @return All files to be searched, or std::nullopt if the given path is not valid.
+ */
+[[nodiscard]] std::optional<std::vector<File>> files(std::string_view path) {
+    std::vector<File> result;
+    const bool valid = visit_files(path, [&](File file) {
+        result.push_back(std::move(file));
+        return true;
+    });
+    if (!valid)
+        return std::nullopt;
+    return result;
+}
+
+constexpr std::string_view snapshot_magic = "minigrep snap 2\n"; /**< The first bytes of a snapshot file. */
+constexpr long long snapshot_slack = 1'000'000'000; /**< How close to a snapshot a directory counts as modified. */
+
+/**
+ * A file list saved by an earlier traversal and memory mapped, so that a traversal of a large tree only lists the
+ * directories that changed since. The file holds a header, the directories, their entries and the arena of the names,
+ * in flat arrays that are used in place.
+ */
+struct Snapshot {
+    /**
+     * The start of a snapshot file.
+     */
+    struct Header {
+        char magic[16];            /**< snapshot_magic. */
+        long long taken;           /**< When the traversal started, in nanoseconds since the epoch. */
+        std::uint64_t directories; /**< The number of directories. */
+        std::uint64_t entries;     /**< The number of entries. */
+        std::uint64_t names;       /**< The size of the arena of the names. */
+    };
+
+    /**
+     * A directory and its entries.
+     */
+    struct Directory {
+        std::uint64_t path;      /**< The offset of the path in the arena, named the way the traversal names it. */
+        std::uint64_t path_size; /**< The length of the path. */
+        long long mtime;         /**< The modification time when it was listed. */
+        std::uint64_t first;     /**< The index of the first entry. */
+        std::uint64_t count;     /**< The number of entries. */
+    };
+
+    /**
+     * A file or a subdirectory. Files keep no metadata, as a file is examined again anyway: appending to it does not
+     * modify its directory.
+     */
+    struct Entry {
+        std::uint64_t name;         /**< The offset of the name in the arena. */
+        std::uint64_t name_size;    /**< The length of the name. */
+        std::uint64_t is_directory; /**< Whether the entry is a subdirectory. */
+    };
+
+    std::shared_ptr<const char> memory;                   /**< The mapping of the file. */
+    Header header{};                                      /**< The header. */
+    const Directory* directories = nullptr;               /**< The directories. */
+    const Entry* entries = nullptr;                       /**< The entries of all directories. */
+    const char* names = nullptr;                          /**< The arena of the names. */
+    std::map<std::string_view, const Directory*> by_path; /**< The directories by path. */
+
+    /**
+     * A name in the arena.
+     * @param offset The offset of the name.
+     * @param size The length of the name.
+     * @return The name.
+     */
+    [[nodiscard]] std::string_view name(std::uint64_t offset, std::uint64_t size) const {
+        return std::string_view(names + offset, size);
+    }
+
+    /**
+     * Looks up a directory.
+     * @param path Path of the directory, named the way the traversal names it.
+     * @return The directory, or nullptr if it is not in the snapshot.
+     */
+    [[nodiscard]] const Directory* find(std::string_view path) const {
+        const auto it = by_path.find(path);
+        return it == by_path.end() ? nullptr : it->second;
+    }
+};
+
+/**
+ * A file list being recorded by a traversal, to be saved as the next snapshot.
+ */
+struct Listing {
+    long long taken = 0;                          /**< When the traversal started. */
+    std::vector<Snapshot::Directory> directories; /**< The directories. */
+    std::vector<Snapshot::Entry> entries;         /**< The entries of all directories. */
+    std::string names;                            /**< The arena of the names. */
+    int listed = 0;                               /**< The directories that were read. */
+    int reused = 0;                               /**< The directories taken from the snapshot. */
+    bool complete = false;                        /**< Whether the traversal finished. */
+
+    /**
+     * Adds a name to the arena.
+     * @param name The name.
+     * @return The offset of the name.
+     */
+    std::uint64_t add(std::string_view name) {
+        names += name;
+        return names.size() - name.size();
+    }
+};
+
+/**
+ * Maps a snapshot file and checks that everything in it lies within the file.
+ * @param path Path of the snapshot file.
+ * @return The snapshot, or std::nullopt if the file is missing or not a valid snapshot.
+ */
+[[nodiscard]] std::optional<Snapshot> load_snapshot(const std::filesystem::path& path) {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return std::nullopt;
+    struct stat st{};
+    const bool sized = ::fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(sizeof(Snapshot::Header));
+    void* map = sized ? ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (map == MAP_FAILED)
+        return std::nullopt;
+    const std::uint64_t size = st.st_size;
+    Snapshot result;
+    result.memory = std::shared_ptr<const char>(static_cast<char*>(map), [=](const char* p) {
+        ::munmap(const_cast<char*>(p), size);
+    });
+    std::memcpy(&result.header, result.memory.get(), sizeof(Snapshot::Header));
+    const auto& header = result.header;
+    if (std::string_view(header.magic, sizeof(header.magic)) != snapshot_magic ||
+        header.directories > size / sizeof(Snapshot::Directory) || header.entries > size / sizeof(Snapshot::Entry) ||
+        sizeof(Snapshot::Header) + header.directories * sizeof(Snapshot::Directory) +
+                header.entries * sizeof(Snapshot::Entry) + header.names != size)
+        return std::nullopt;
+    const char* data = result.memory.get() + sizeof(Snapshot::Header);
+    result.directories = reinterpret_cast<const Snapshot::Directory*>(data);
+    result.entries = reinterpret_cast<const Snapshot::Entry*>(data + header.directories * sizeof(Snapshot::Directory));
+    result.names = data + header.directories * sizeof(Snapshot::Directory) + header.entries * sizeof(Snapshot::Entry);
+    auto fits = [&](std::uint64_t begin, std::uint64_t count, std::uint64_t total) {
+        return begin <= total && count <= total - begin;
+    };
+    for (std::uint64_t i = 0; i < header.entries; ++i)
+        if (!fits(result.entries[i].name, result.entries[i].name_size, header.names))
+            return std::nullopt;
+    for (std::uint64_t i = 0; i < header.directories; ++i) {
+        const auto& directory = result.directories[i];
+        if (!fits(directory.path, directory.path_size, header.names) ||
+            !fits(directory.first, directory.count, header.entries))
+            return std::nullopt;
+        result.by_path.emplace(result.name(directory.path, directory.path_size), &directory);
+    }
+    return result;
+}
+
+/**
+ * Saves a listing as a snapshot, replacing the previous one only once it is complete.
+ * @param path Path of the snapshot file.
+ * @param listing The listing.
+ * @return Whether the snapshot was written.
+ */
+[[nodiscard]] bool save_snapshot(const std::filesystem::path& path, const Listing& listing) {
+    auto temporary = path;
+    temporary += ".tmp";
+    {
+        std::ofstream os(temporary, std::ios::binary);
+        Snapshot::Header header{{}, listing.taken, listing.directories.size(), listing.entries.size(),
+                                listing.names.size()};
+        std::copy(snapshot_magic.begin(), snapshot_magic.end(), header.magic);
+        os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        os.write(reinterpret_cast<const char*>(listing.directories.data()),
+                 listing.directories.size() * sizeof(Snapshot::Directory));
+        os.write(reinterpret_cast<const char*>(listing.entries.data()),
+                 listing.entries.size() * sizeof(Snapshot::Entry));
+        os << listing.names;
+        if (!os.flush())
+            return false;
+    }
+    std::error_code error;
+    std::filesystem::rename(temporary, path, error); // the old snapshot stays valid for anyone who has it mapped
+    return !error;
+}
+
+/**
+ * Hands each file in a directory tree to a function like visit_files, but takes the entries of every directory whose
+ * modification time is the one in the snapshot from there instead of listing it. A directory modified shortly before
+ * the snapshot was taken is listed again, as a change within the same tick of its clock would go unnoticed. The files
+ * are still examined, as appending to a file does not modify its directory.
+ * @param directory Path to the directory.
+ * @param snapshot The snapshot of an earlier traversal, or nullptr.
+ * @param listing The listing to record the traversal in.
+ * @param visit The function to call with every file, returning false to stop the traversal.
+ * @return Whether the traversal was not stopped.
+ */
+bool visit_snapshot(const std::filesystem::path& directory, const Snapshot* snapshot, Listing& listing,
+                    const std::function<bool(File)>& visit) {
+    struct stat st{};
+    if (::stat(directory.c_str(), &st) != 0)
+        return true;
+    const long long modified = mtime(st);
+    std::vector<std::pair<std::string, bool>> children; // the names, and whether they are directories
+    const auto* known = snapshot ? snapshot->find(directory.native()) : nullptr;
+    if (known && known->mtime == modified && modified < snapshot->header.taken - snapshot_slack) {
+        for (std::uint64_t i = 0; i < known->count; ++i) {
+            const auto& entry = snapshot->entries[known->first + i];
+            children.emplace_back(snapshot->name(entry.name, entry.name_size), entry.is_directory != 0);
+        }
+        listing.reused++;
+    } else {
+        for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+            const bool subdirectory = !entry.is_symlink() && entry.is_directory(); // as the recursive iterator does
+            if (subdirectory || entry.is_regular_file())
+                children.emplace_back(entry.path().filename().string(), subdirectory);
+        }
+        listing.listed++;
+    }
+    const std::size_t first = listing.entries.size();
+    const auto& name = directory.native();
+    listing.directories.push_back(
+        Snapshot::Directory{listing.add(name), name.size(), modified, first, children.size()});
+    for (const auto& [name, subdirectory] : children)
+        listing.entries.push_back(Snapshot::Entry{listing.add(name), name.size(), subdirectory});
+    for (std::size_t i = 0; i < children.size(); ++i) {
+        const auto path = directory / children[i].first;
+        if (children[i].second) {
+            if (!visit_snapshot(path, snapshot, listing, visit))
+                return false;
+            continue;
+        }
+        if (!visit(File(path.string())))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * A growable array of trivially copyable values that starts out on the heap and can be moved to a memory mapped
+ * temporary file. The kernel writes the pages of a spilled column back to its file under memory pressure instead of
+ * the process running out of memory.
+ */
+template <typename T> struct Column {
+    std::vector<T> values;    /**< The values while on the heap. */
+    int fd = -1;              /**< The unlinked temporary file once spilled. */
+    T* map = nullptr;         /**< The mapping of the file. */
+    std::size_t count = 0;    /**< The number of values once spilled. */
+    std::size_t capacity = 0; /**< The number of values the file has room for. */
+
+    Column() = default;
+    Column(const Column&) = delete;
+    Column& operator=(const Column&) = delete;
+
+    /**
+     * Unmaps and closes the file.
+     */
+    ~Column() {
+        if (map)
+            ::munmap(map, capacity * sizeof(T));
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    /**
+     * The number of values.
+     * @return The number of values.
+     */
+    [[nodiscard]] std::size_t size() const { return fd < 0 ? values.size() : count; }
+
+    /**
+     * A value.
+     * @param i The index of the value.
+     * @return The value.
+     */
+    [[nodiscard]] const T& operator[](std::size_t i) const { return fd < 0 ? values[i] : map[i]; }
+
+    /**
+     * Appends values, growing the file of a spilled column.
+     * @param data The values.
+     * @param n The number of values.
+     * @return Whether the values were appended, false if the file could not grow.
+     */
+    bool append(const T* data, std::size_t n) {
+        if (fd < 0) {
+            values.insert(values.end(), data, data + n);
+            return true;
+        }
+        if (count + n > capacity && !reserve(std::max(capacity * 2, count + n)))
+            return false;
+        std::copy(data, data + n, map + count);
+        count += n;
+        return true;
+    }
+
+    /**
+     * Drops the pages of a spilled column from the process. Their contents stay in the page cache, from which the
+     * kernel writes them back to the file or reads them in again when accessed.
+     */
+    void release() const {
+        if (map)
+            ::madvise(map, count * sizeof(T) / page_size * page_size, MADV_DONTNEED);
+    }
+
+    /**
+     * Moves the values to a temporary file.
+     * @param directory The directory to create the file in.
+     * @return Whether the column is spilled.
+     */
+    bool spill(const std::filesystem::path& directory) {
+        if (fd >= 0)
+            return true;
+        auto name = (directory / "minigrep-XXXXXX").string();
+        if ((fd = ::mkstemp(name.data())) < 0)
+            return false;
+        ::unlink(name.c_str());
+        if (!reserve(std::max(values.size() * 2, page_size / sizeof(T)))) {
+            ::close(fd);
+            fd = -1;
+            return false;
+        }
+        std::copy(values.begin(), values.end(), map);
+        count = values.size();
+        std::vector<T>().swap(values);
+        return true;
+    }
+
+  private:
+    /**
+     * Grows the file and its mapping. The blocks are allocated up front, so that a full disk shows up here and not
+     * as a fault when the mapping is written.
+     * @param size The number of values to make room for.
+     * @return Whether the file grew.
+     */
+    bool reserve(std::size_t size) {
+        const std::size_t bytes = size * sizeof(T);
+        if (::posix_fallocate(fd, 0, bytes) != 0)
+            return false;
+        void* grown = map ? ::mremap(map, capacity * sizeof(T), bytes, MREMAP_MAYMOVE)
+                          : ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (grown == MAP_FAILED)
+            return false;
+        map = static_cast<T*>(grown);
+        capacity = size;
+        return true;
+    }
+};
+
+/**
+ * The files of a traversal in a compact table of columns. A path is stored as the index of its directory and its
+ * name in an arena, and directories are stored the same way, so that a file costs its name and a few dozen bytes
+ * instead of a File with a heap allocated path. Once the table outgrows its memory budget, its columns spill to
+ * memory mapped temporary files.
+ */
+struct FileTable {
+    static constexpr std::uint32_t none = std::numeric_limits<std::uint32_t>::max(); /**< No directory. */
+    static constexpr std::size_t release_rows = 1 << 16; /**< The rows after which a spilled table drops its pages. */
+
+    long long limit;                             /**< The memory the table may take up before it spills. */
+    Column<char> names;                          /**< The arena of the names. */
+    Column<std::uint32_t> directory_parents;     /**< The parent of every directory, none for a top directory. */
+    Column<std::uint64_t> directory_names;       /**< The offset of the name of every directory. */
+    Column<std::uint32_t> directory_name_sizes;  /**< The length of the name of every directory. */
+    Column<std::uint32_t> parents;               /**< The directory of every file, none if its path has no slash. */
+    Column<std::uint64_t> file_names;            /**< The offset of the name of every file. */
+    Column<std::uint16_t> file_name_sizes;       /**< The length of the name of every file. */
+    Column<long long> sizes;                     /**< The size of every file. */
+    Column<long long> mtimes;                    /**< The modification time of every file. */
+    Column<unsigned long long> inodes;           /**< The inode of every file. */
+    Column<std::uint8_t> devices;                /**< The filesystem of every file, plus 128 if it is rotational. */
+    std::vector<std::pair<std::string, std::uint32_t>> chain; /**< The directories leading to the last file added. */
+    bool spilled = false;                        /**< Whether the columns live in temporary files. */
+    bool failed = false;                         /**< Whether a spilled column could not grow. */
+
+    /**
+     * Creates an empty table.
+     * @param limit The memory the table may take up before it spills.
+     */
+    explicit FileTable(long long limit) : limit(limit) {}
+
+    /**
+     * The number of files.
+     * @return The number of files.
+     */
+    [[nodiscard]] std::size_t size() const { return parents.size(); }
+
+    /**
+     * The memory the columns take up, on the heap or in their files.
+     * @return The size in bytes.
+     */
+    [[nodiscard]] long long bytes() const {
+        return names.size() + directory_parents.size() * (4 + 8 + 4) + parents.size() * (4 + 8 + 2 + 8 + 8 + 8 + 1);
+    }
+
+    /**
+     * Adds a file, spilling the table once it outgrows its budget.
+     * @param file The file.
+     */
+    void add(const File& file) {
+        const std::string_view path = file.path;
+        const auto slash = path.rfind('/');
+        const std::string_view name = slash == std::string_view::npos ? path : path.substr(slash + 1);
+        const std::uint32_t parent = slash == std::string_view::npos ? none : directory(path.substr(0, slash));
+        const auto device = static_cast<std::uint8_t>(static_cast<int>(file.filesystem) | (file.rotational ? 128 : 0));
+        put(parents, parent);
+        put(file_names, static_cast<std::uint64_t>(names.size()));
+        put(file_name_sizes, static_cast<std::uint16_t>(name.size()));
+        failed |= !names.append(name.data(), name.size());
+        put(sizes, file.size);
+        put(mtimes, file.mtime);
+        put(inodes, file.inode);
+        put(devices, device);
+        if (!spilled && bytes() > limit) {
+            const auto directory = std::filesystem::temp_directory_path();
+            spilled = names.spill(directory) && directory_parents.spill(directory) &&
+                      directory_names.spill(directory) && directory_name_sizes.spill(directory) &&
+                      parents.spill(directory) && file_names.spill(directory) && file_name_sizes.spill(directory) &&
+                      sizes.spill(directory) && mtimes.spill(directory) && inodes.spill(directory) &&
+                      devices.spill(directory);
+            limit = spilled ? limit : std::numeric_limits<long long>::max(); // stay on the heap if there is no room
+        }
+        if (spilled && size() % release_rows == 0)
+            release();
+    }
+
+    /**
+     * Drops the pages of the spilled columns from the process, so that the table costs page cache the kernel can
+     * reclaim rather than resident memory.
+     */
+    void release() const {
+        names.release(), directory_parents.release(), directory_names.release(), directory_name_sizes.release();
+        parents.release(), file_names.release(), file_name_sizes.release(), sizes.release(), mtimes.release();
+        inodes.release(), devices.release();
+    }
+
+    /**
+     * The file in a row, without examining it again.
+     * @param row The row.
+     * @return The file.
+     */
+    [[nodiscard]] File file(std::size_t row) const {
+        File result;
+        const std::string_view name(&names[file_names[row]], file_name_sizes[row]);
+        result.path = parents[row] == none ? std::string(name) : path(parents[row]) + '/' + std::string(name);
+        result.size = sizes[row];
+        result.mtime = mtimes[row];
+        result.inode = inodes[row];
+        result.filesystem = static_cast<Filesystem>(devices[row] & 127);
+        result.rotational = devices[row] & 128;
+        return result;
+    }
+
+  private:
+    /**
+     * Appends a value to a column, remembering if it failed.
+     * @param column The column.
+     * @param value The value.
+     */
+    template <typename T> void put(Column<T>& column, const T& value) { failed |= !column.append(&value, 1); }
+
+    /**
+     * The path of a directory.
+     * @param id The directory.
+     * @return The path.
+     */
+    [[nodiscard]] std::string path(std::uint32_t id) const {
+        const std::string_view name(&names[directory_names[id]], directory_name_sizes[id]);
+        const auto parent = directory_parents[id];
+        return parent == none ? std::string(name) : path(parent) + '/' + std::string(name);
+    }
+
+    /**
+     * Finds the directory of a file, adding the directories missing from the table. The traversal is depth first, so
+     * the directories are found on the chain that led to the previous file.
+     * @param path Path of the directory.
+     * @return The directory.
+     */
+    std::uint32_t directory(std::string_view path) {
+        auto contains = [&](std::string_view ancestor) {
+            return path == ancestor || (path.starts_with(ancestor) && path[ancestor.size()] == '/');
+        };
+        while (!chain.empty() && !contains(chain.back().first))
+            chain.pop_back();
+        auto add = [&](std::string_view name, std::uint32_t parent, std::size_t length) {
+            const auto id = static_cast<std::uint32_t>(directory_parents.size());
+            put(directory_parents, parent);
+            put(directory_names, static_cast<std::uint64_t>(names.size()));
+            put(directory_name_sizes, static_cast<std::uint32_t>(name.size()));
+            failed |= !names.append(name.data(), name.size());
+            chain.emplace_back(path.substr(0, length), id);
+        };
+        if (chain.empty()) { // a top directory, then one directory per component like below
+            const std::size_t end = std::min(path.find('/'), path.size());
+            add(path.substr(0, end), none, end);
+        }
+        while (chain.back().first.size() < path.size()) {
+            const std::size_t begin = chain.back().first.size() + 1;
+            const std::size_t end = std::min(path.find('/', begin), path.size());
+            add(path.substr(begin, end - begin), chain.back().second, end);
+        }
+        return chain.back().second;
+    }
+};
+
+/**
+ * The orders in which files can be searched.
+ */
+enum class Order { directory, physical, size_desc, mtime_desc, size_asc, list };
+
+constexpr std::array<std::string_view, 6> order_names{"directory", "physical",  "size-desc",
+                                                      "mtime-desc", "size-asc", "list"}; /**< Indexed by Order. */
+
+/**
+ * Whether files are searched in an order that can be kept while the traversal is still running.
+ * @param order The order.
+ * @return True if the traversal feeds the scan, false if the files have to be sorted as a whole first.
+ */
+[[nodiscard]] constexpr bool fed(Order order) {
+    return order == Order::mtime_desc || order == Order::size_asc || order == Order::list;
+}
+
+/**
+ * The priority of a file in an order that the traversal feeds to the scan.
+ * @param file The file.
+ * @param order The order.
+ * @return The priority, files with lower values are searched first.
+ */
+[[nodiscard]] long long priority(const File& file, Order order) {
+    return order == Order::mtime_desc ? -file.mtime : order == Order::size_asc ? file.size : 0;
+}
+
+/**
+ * Looks up where the first block of a file lies on its disk.
+ * @param path Path of the file.
+ * @return The physical byte offset of the first extent, or std::nullopt if the filesystem does not support FIEMAP.
+ */
+[[nodiscard]] std::optional<std::uint64_t> physical_offset(const std::string& path) {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return std::nullopt;
+    alignas(fiemap) char buffer[sizeof(fiemap) + sizeof(fiemap_extent)]{}; // room for the first extent
+    auto* map = reinterpret_cast<fiemap*>(buffer);
+    map->fm_length = FIEMAP_MAX_OFFSET;
+    map->fm_extent_count = 1;
+    const int result = ::ioctl(fd, FS_IOC_FIEMAP, map);
+    ::close(fd);
+    if (result != 0 || map->fm_mapped_extents == 0)
+        return std::nullopt;
+    return map->fm_extents[0].fe_physical;
+}
+
+/**
+ * Where the data of a file lies. Files on filesystems without FIEMAP (and empty or inline files) are ordered by inode
+ * number, which most filesystems allocate close to the data.
+ * @param path Path of the file.
+ * @return The device, the physical byte offset of the first extent and the inode, zero where unknown.
+ */
+[[nodiscard]] std::tuple<dev_t, std::uint64_t, ino_t> physical_key(const std::string& path) {
+    struct stat st{};
+    if (::stat(path.c_str(), &st) != 0)
+        st = {};
+    return {st.st_dev, physical_offset(path).value_or(0), st.st_ino};
+}
+
+/**
+ * Sorts files by where their data lies, so that a rotational disk reads them in one sweep instead of seeking back
+ * and forth. The sort is stable, files that cannot be located keep their order.
+ * @param files The files to sort.
+ */
+void sort_physical(std::vector<File>& files) {
+    std::vector<std::pair<std::tuple<dev_t, std::uint64_t, ino_t>, File>> keyed;
+    keyed.reserve(files.size());
+    for (auto& file : files)
+        keyed.emplace_back(physical_key(file.path), std::move(file));
+    std::stable_sort(keyed.begin(), keyed.end(), [](const auto& l, const auto& r) { return l.first < r.first; });
+    for (std::size_t i = 0; i < files.size(); ++i)
+        files[i] = std::move(keyed[i].second);
+}
+
+/**
+ * Orders the rows of a file table by where the data of their files lies, like sort_physical, without taking the files
+ * out of the table.
+ * @param table The table.
+ * @return The rows in physical order.
+ */
+[[nodiscard]] std::vector<std::uint32_t> physical_rows(const FileTable& table) {
+    std::vector<std::pair<std::tuple<dev_t, std::uint64_t, ino_t>, std::uint32_t>> keyed;
+    keyed.reserve(table.size());
+    for (std::size_t row = 0; row < table.size(); ++row) {
+        keyed.emplace_back(physical_key(table.file(row).path), static_cast<std::uint32_t>(row));
+        if ((row + 1) % FileTable::release_rows == 0 && table.spilled)
+            table.release();
+    }
+    std::stable_sort(keyed.begin(), keyed.end(), [](const auto& l, const auto& r) { return l.first < r.first; });
+    std::vector<std::uint32_t> result;
+    result.reserve(keyed.size());
+    for (const auto& [key, row] : keyed)
+        result.push_back(row);
+    return result;
+}
+
+/**
+ * Orders the rows of a file table by the size of their files, largest first, files of equal size keeping their order.
+ * @param table The table.
+ * @return The rows by descending size.
+ */
+[[nodiscard]] std::vector<std::uint32_t> largest_rows(const FileTable& table) {
+    std::vector<std::uint32_t> result(table.size());
+    for (std::size_t row = 0; row < result.size(); ++row)
+        result[row] = static_cast<std::uint32_t>(row);
+    std::stable_sort(result.begin(), result.end(),
+                     [&](std::uint32_t l, std::uint32_t r) { return table.sizes[l] > table.sizes[r]; });
+    return result;
+}
+
+/**
+ * Splits a range of the file into chunks.
+ * @param file File to be split.
+ * @param range The range to be searched.
+ * @param max_size The maximum size of a chunk.
+ * @param needle_size The length of the searched string.
+ * @return Chunks that correspond to the range as a whole, none if it is empty.
+ */
+[[nodiscard]] std::vector<FileChunk> chunks(const File& file, const Range& range, long long max_size,
+                                            int needle_size) {
+    if (range.size() <= 0)
+        return {};
+    std::vector<FileChunk> result{FileChunk(file, range, needle_size)};
+    std::optional<std::pair<Range, Range>> split_chunks;
+    while ((split_chunks = result.back().search.split(max_size))) {
+        result.back() = FileChunk(file, split_chunks.value().first, needle_size);
+        result.emplace_back(file, split_chunks.value().second, needle_size);
+    }
+    return result;
+}
+
+/**
+ * Splits the file into chunks.
+ * @param file File to be split.
+ * @param max_size The maximum size of a chunk.
+ * @param needle_size The length of the searched string.
+ * @return Chunks that correspond to the file as a whole, none if it is empty.
+ */
+[[nodiscard]] std::vector<FileChunk> chunks(const File& file, long long max_size, int needle_size) {
+    return chunks(file, Range{0, file.size}, max_size, needle_size);
+}
+
+/**
+ * Orders chunks largest first, so that the long tasks start early and the short ones fill the gaps at the end, and
+ * no worker is left grinding through a big chunk long after the others ran out of work. Chunks of equal size keep
+ * their order, so the full chunks of a large file are still read front to back.
+ * @param chunks The chunks to sort.
+ */
+void sort_largest_first(std::vector<FileChunk>& chunks) {
+    std::stable_sort(chunks.begin(), chunks.end(),
+                     [](const FileChunk& l, const FileChunk& r) { return l.search.size() > r.search.size(); });
+}
+
+/**
+ * The pages covering a range of a file.
+ * @param range The range in bytes.
+ * @return The range of page numbers.
+ */
+[[nodiscard]] constexpr Range pages(const Range& range) {
+    return Range{range.begin / page_size, (range.end + page_size - 1) / page_size};
+}
+
+/**
+ * Marks the chunks whose read range is not entirely in the page cache, from the probe of their file, which is made
+ * now unless choosing the I/O method made it already. Files that are not probed count as cached.
+ * @param chunks The chunks of a single file.
+ */
+void mark_cold(std::vector<FileChunk>& chunks) {
+    if (chunks.empty())
+        return;
+    const auto& resident = chunks.front().file.probe_residency();
+    for (auto& chunk : chunks) {
+        const Range range = pages(chunk.read);
+        chunk.cold = !resident.empty() && !std::all_of(resident.begin() + range.begin, resident.begin() + range.end,
+                                                       [](bool page) { return page; });
+    }
+}
+
+/**
+ * The bucket of a trigram in the signature of a file.
+ * @param a The first character.
+ * @param b The second character.
+ * @param c The third character.
+ * @return The bucket, less than index_bits.
+ */
+[[nodiscard]] constexpr int trigram_bucket(unsigned char a, unsigned char b, unsigned char c) {
+    return static_cast<int>(((a << 16 | b << 8 | c) * 2654435761u) >> 16); // Fibonacci hashing to 16 bits
+}
+
+/**
+ * The buckets of all the trigrams of a needle.
+ * @param needle The searched string.
+ * @return The distinct buckets, empty if the needle is shorter than a trigram.
+ */
+[[nodiscard]] constexpr std::vector<int> trigram_buckets(std::string_view needle) {
+    std::vector<int> result;
+    for (std::size_t i = 0; i + 2 < needle.size(); ++i)
+        result.push_back(trigram_bucket(needle[i], needle[i + 1], needle[i + 2]));
+    std::sort(result.begin(), result.end());
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+}
+
+using Signature = std::vector<std::uint16_t>; /**< The sorted trigram buckets that occur in a file. */
+
+/**
+ * A file as recorded by the index.
+ */
+struct IndexEntry {
+    std::string path;    /**< The path relative to the root of the index. */
+    long long size;      /**< The size of the file when it was indexed. */
+    long long mtime;     /**< The modification time in nanoseconds when it was indexed. */
+    Signature signature; /**< The trigrams of the file when it was indexed. */
+};
+
+/**
+ * Trigram signatures of every file under a directory.
+ */
+struct Index {
+    std::filesystem::path root;      /**< The canonical path of the indexed directory. */
+    std::vector<IndexEntry> entries; /**< The indexed files. */
+    std::map<std::string, long long> directories; /**< The modification time of every directory, by relative path. */
+};
+
+/**
+ * Computes the signature of a file.
+ * @param path Path of the file.
+ * @return The trigram buckets that occur in the file.
+ */
+[[nodiscard]] Signature signature(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return {};
+    auto buckets = std::make_unique<std::bitset<index_bits>>();
+    std::vector<char> buffer(1 << 20);
+    unsigned char a = 0, b = 0; // the last two characters of the previous block
+    long long offset = 0;
+    for (ssize_t n; (n = ::pread(fd, buffer.data(), buffer.size(), offset)) > 0; offset += n)
+        for (ssize_t i = 0; i < n; ++i) {
+            const unsigned char c = buffer[i];
+            if (offset + i >= 2)
+                buckets->set(trigram_bucket(a, b, c));
+            a = b, b = c;
+        }
+    ::close(fd);
+    Signature result;
+    for (int i = 0; i < index_bits; ++i)
+        if (buckets->test(i))
+            result.push_back(i);
+    return result;
+}
+
+/**
+ * Indexes every file under a directory.
+ * @param root The directory to index.
+ * @param workers The number of threads computing signatures.
+ * @return The index, or std::nullopt if the root is not a directory.
+ */
+[[nodiscard]] std::optional<Index> build_index(const std::filesystem::path& root, int workers) {
+    if (!std::filesystem::is_directory(root))
+        return std::nullopt;
+    Index result{std::filesystem::canonical(root), {}, {}};
+    auto record = [&](const std::filesystem::path& directory, std::string relative) {
+        struct stat st{};
+        if (::stat(directory.c_str(), &st) == 0)
+            result.directories[std::move(relative)] = mtime(st);
+    };
+    record(root, "");
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(root)) {
+        if (entry.is_regular_file())
+            result.entries.push_back(IndexEntry{entry.path().lexically_relative(root).generic_string(), 0, 0, {}});
+        else if (entry.is_directory())
+            record(entry.path(), entry.path().lexically_relative(root).generic_string());
+    }
+    std::atomic<std::size_t> next = 0;
+    std::vector<std::jthread> threads;
+    for (int i = 0; i < workers; ++i)
+        threads.emplace_back([&] {
+            for (std::size_t i; (i = next++) < result.entries.size();) {
+                auto& entry = result.entries[i];
+                const auto path = (root / entry.path).string();
+                struct stat st{};
+                if (::stat(path.c_str(), &st) != 0)
+                    continue;
+                entry.size = st.st_size, entry.mtime = mtime(st);
+                entry.signature = signature(path);
+            }
+        });
+    threads.clear();
+    return result;
+}
+
+constexpr std::string_view index_magic = "minigrep index 3\n"; /**< The first bytes of an index file. */
+
+/**
+ * Saves an index.
+ * @param path Path of the index file.
+ * @param index The index to save.
+ * @return Whether the index was written.
+ */
+[[nodiscard]] bool save_index(const std::filesystem::path& path, const Index& index) {
+    std::ofstream os(path, std::ios::binary);
+    auto write = [&](const auto& value) { os.write(reinterpret_cast<const char*>(&value), sizeof(value)); };
+    os << index_magic << index.root.string() << '\n';
+    write(index.entries.size());
+    for (const auto& entry : index.entries) {
+        write(entry.path.size());
+        os << entry.path;
+        write(entry.size), write(entry.mtime), write(entry.signature.size());
+        os.write(reinterpret_cast<const char*>(entry.signature.data()), entry.signature.size() * sizeof(std::uint16_t));
+    }
+    write(index.directories.size());
+    for (const auto& [directory, mtime] : index.directories) {
+        write(directory.size());
+        os << directory;
+        write(mtime);
+    }
+    return static_cast<bool>(os);
+}
+
+/**
+ * Loads an index.
+ * @param path Path of the index file.
+ * @return The index, or std::nullopt if the file is missing or not an index.
+ */
+[[nodiscard]] std::optional<Index> load_index(const std::filesystem::path& path) {
+    std::ifstream is(path, std::ios::binary);
+    auto read = [&](auto& value) { return static_cast<bool>(is.read(reinterpret_cast<char*>(&value), sizeof(value))); };
+    std::string magic(index_magic.size(), '\0'), root;
+    if (!is.read(magic.data(), magic.size()) || magic != index_magic || !std::getline(is, root))
+        return std::nullopt;
+    Index result{root, {}, {}};
+    std::size_t count = 0;
+    if (!read(count))
+        return std::nullopt;
+    result.entries.resize(count);
+    for (auto& entry : result.entries) {
+        std::size_t length = 0, buckets = 0;
+        if (!read(length))
+            return std::nullopt;
+        entry.path.resize(length);
+        if (!is.read(entry.path.data(), length) || !read(entry.size) || !read(entry.mtime) || !read(buckets))
+            return std::nullopt;
+        entry.signature.resize(buckets);
+        if (!is.read(reinterpret_cast<char*>(entry.signature.data()), buckets * sizeof(std::uint16_t)))
+            return std::nullopt;
+    }
+    if (!read(count))
+        return std::nullopt;
+    for (std::size_t i = 0; i < count; ++i) {
+        std::size_t length = 0;
+        long long mtime = 0;
+        std::string directory;
+        if (!read(length))
+            return std::nullopt;
+        directory.resize(length);
+        if (!is.read(directory.data(), length) || !read(mtime))
+            return std::nullopt;
+        result.directories.emplace(std::move(directory), mtime);
+    }
+    return result;
+}
+
+/**
+ * How the files of a directory are found.
+ */
+enum class Strategy { index, scan };
+
+constexpr std::array<std::string_view, 2> strategy_names{"index", "scan"}; /**< Indexed by Strategy. */
+
+/**
+ * Decides whether the index pays off for a directory.
+ * @param estimate The estimated fraction of the directory's bytes that the index cannot rule out.
+ * @param needle_size The length of the searched string.
+ * @param threshold The candidate percentage below which the index is used.
+ * @return Strategy::index if verifying the candidates reads clearly less than scanning everything.
+ */
+[[nodiscard]] constexpr Strategy choose_strategy(double estimate, int needle_size, int threshold) {
+    return needle_size >= 3 && estimate * 100 < threshold ? Strategy::index : Strategy::scan;
+}
+
+/**
+ * The plan for one top level directory of the index.
+ */
+struct DirectoryPlan {
+    std::string directory;               /**< The directory relative to the root, empty for the root's own files. */
+    long long files = 0;                 /**< The number of indexed files. */
+    long long bytes = 0;                 /**< The number of indexed bytes. */
+    double estimate = 1;                 /**< The estimated fraction of the bytes in candidate files. */
+    Strategy strategy = Strategy::scan;  /**< How the files are found. */
+    std::vector<std::size_t> entries;    /**< The indexed files in the directory. */
+    std::vector<std::size_t> candidates; /**< The indexed files that may contain the needle. */
+};
+
+/**
+ * Plans a query per top level directory. The selectivity of the needle is estimated from the bytes covered by the
+ * rarest of its trigram buckets, which bounds the candidates from above without looking at the files.
+ * @param index The index.
+ * @param needle The searched string.
+ * @param threshold The candidate percentage below which the index is used.
+ * @param forced The strategy forced on every directory, if any.
+ * @return The plan of every directory.
+ */
+[[nodiscard]] std::vector<DirectoryPlan> plan(const Index& index, std::string_view needle, int threshold,
+                                              std::optional<Strategy> forced) {
+    const auto buckets = trigram_buckets(needle);
+    std::map<std::string, std::pair<DirectoryPlan, std::vector<long long>>> directories;
+    for (std::size_t i = 0; i < index.entries.size(); ++i) {
+        const auto& entry = index.entries[i];
+        const auto slash = entry.path.find('/');
+        auto& [plan, bucket_bytes] = directories[slash == std::string::npos ? "" : entry.path.substr(0, slash)];
+        bucket_bytes.resize(buckets.size());
+        plan.files++;
+        plan.bytes += entry.size;
+        plan.entries.push_back(i);
+        bool candidate = true;
+        for (std::size_t b = 0; b < buckets.size(); ++b) {
+            const bool set = std::binary_search(entry.signature.begin(), entry.signature.end(), buckets[b]);
+            bucket_bytes[b] += set ? entry.size : 0;
+            candidate &= set;
+        }
+        if (candidate)
+            plan.candidates.push_back(i);
+    }
+    std::vector<DirectoryPlan> result;
+    for (auto& [directory, value] : directories) {
+        auto& [plan, bucket_bytes] = value;
+        plan.directory = directory;
+        for (const auto& bytes : bucket_bytes)
+            plan.estimate = std::min(plan.estimate, plan.bytes ? static_cast<double>(bytes) / plan.bytes : 0);
+        plan.strategy = forced.value_or(choose_strategy(plan.estimate, needle.size(), threshold));
+        result.push_back(std::move(plan));
+    }
+    return result;
+}
+
+/**
+ * Prints a plan.
+ * @param os The stream to print to.
+ * @param plans The plan of every directory.
+ */
+void explain(std::ostream& os, const std::vector<DirectoryPlan>& plans) {
+    for (const auto& plan : plans) {
+        os << (plan.directory.empty() ? "." : plan.directory) << ": "
+           << strategy_names[static_cast<int>(plan.strategy)] << ", estimated " << plan.estimate * 100 << "% of "
+           << plan.bytes << " bytes in " << plan.files << " files";
+        if (plan.strategy == Strategy::index)
+            os << ", " << plan.candidates.size() << " candidates";
+        os << "\n";
+    }
+}
+
+/**
+ * Computes which files are to be searched according to a plan. Directories using the index verify its candidates and
+ * every file that changed since it was indexed, the others are traversed. What the index does not cover is traversed
+ * as well: the directories whose modification time changed since indexing are listed for new files and
+ * subdirectories, and top level directories without a plan are searched whole. Directories removed since are skipped.
+ * @param index The index.
+ * @param plans The plan of every directory.
+ * @param root Path to the searched directory, as given on the command line.
+ * @return All files to be searched.
+ */
+[[nodiscard]] std::vector<File> planned_files(const Index& index, const std::vector<DirectoryPlan>& plans,
+                                              const std::filesystem::path& root) {
+    std::vector<File> result;
+    auto traverse = [&](const std::filesystem::path& directory) {
+        if (const auto found = files(directory.string()))
+            result.insert(result.end(), found->begin(), found->end());
+    };
+    std::set<std::string_view> indexed;
+    for (const auto& entry : index.entries)
+        indexed.insert(entry.path);
+    // lists a directory that changed since indexing, its subdirectories belong to other plans at the top level
+    auto changed = [&](const std::string& relative, long long indexed_mtime) {
+        struct stat st{};
+        const auto directory = relative.empty() ? root : root / relative;
+        if (::stat(directory.c_str(), &st) != 0 || mtime(st) == indexed_mtime)
+            return;
+        std::error_code error;
+        for (const auto& entry : std::filesystem::directory_iterator(directory, error)) {
+            const auto path = entry.path().lexically_relative(root).generic_string();
+            if (entry.is_regular_file() && !indexed.contains(path))
+                result.emplace_back(entry.path().string());
+            else if (entry.is_directory() && !relative.empty() && !index.directories.contains(path))
+                traverse(entry.path());
+        }
+    };
+    std::set<std::string> planned;
+    for (const auto& plan : plans) {
+        planned.insert(plan.directory);
+        if (plan.strategy == Strategy::scan && !plan.directory.empty()) {
+            traverse(root / plan.directory);
+        } else if (plan.strategy == Strategy::scan) {
+            std::error_code error;
+            for (const auto& entry : std::filesystem::directory_iterator(root, error))
+                if (entry.is_regular_file())
+                    result.emplace_back(entry.path().string());
+        } else {
+            for (const auto& i : plan.entries) {
+                const auto& entry = index.entries[i];
+                const auto path = (root / entry.path).string();
+                struct stat st{};
+                if (::stat(path.c_str(), &st) != 0)
+                    continue;
+                if (std::binary_search(plan.candidates.begin(), plan.candidates.end(), i) ||
+                    st.st_size != entry.size || mtime(st) != entry.mtime)
+                    result.emplace_back(path);
+            }
+            for (const auto& [relative, mtime] : index.directories)
+                if (relative == plan.directory ||
+                    (!plan.directory.empty() && relative.starts_with(plan.directory + "/")))
+                    changed(relative, mtime);
+        }
+    }
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator(root, error)) {
+        const auto name = entry.path().filename().string();
+        if (entry.is_directory() && !planned.contains(name))
+            traverse(entry.path());
+        else if (entry.is_regular_file() && !planned.contains(""))
+            result.emplace_back(entry.path().string());
+    }
+    return result;
+}
+
+/**
+ * Counters describing a scan.
+ */
+struct Stats {
+    std::atomic<long long> chunks = 0;  /**< The number of chunks searched. */
+    std::atomic<long long> bytes = 0;   /**< The number of bytes searched. */
+    std::atomic<long long> matches = 0; /**< The number of matches found. */
+    std::array<std::atomic<long long>, io_names.size()> io_chunks{}; /**< The number of chunks per I/O method. */
+    std::array<std::atomic<long long>, io_names.size()> io_bytes{};  /**< The number of bytes read per I/O method. */
+    std::array<std::atomic<long long>, filesystem_names.size()> filesystem_chunks{}; /**< Chunks per filesystem. */
+    std::array<std::atomic<long long>, 32> latency{}; /**< The number of reads per power of two microseconds taken. */
+    std::atomic<long long> timeouts = 0;              /**< The number of chunks skipped as their read timed out. */
+    std::atomic<long long> hedges = 0;                /**< The number of slow reads that were issued again. */
+    std::atomic<long long> hedge_wins = 0;            /**< The number of hedged reads that finished first. */
+    std::atomic<long long> cold_chunks = 0;           /**< The number of chunks taken from the I/O queue. */
+    std::atomic<long long> steals = 0;                /**< The number of chunks split by idle workers. */
+    std::atomic<bool> expired = false;                /**< Whether the scan was cancelled at its deadline. */
+    std::atomic<long long> idle = 0;                  /**< Microseconds workers waited for the others at the end. */
+};
+
+/**
+ * The power of two bucket of a latency.
+ * @param microseconds The latency.
+ * @return The bucket, the number of bits needed to represent the latency.
+ */
+[[nodiscard]] constexpr int latency_bucket(long long microseconds) {
+    int result = 0;
+    for (; microseconds > 0 && result < 31; microseconds >>= 1)
+        ++result;
+    return result;
+}
+
+/**
+ * An upper bound of a percentile of latencies.
+ * @param histogram The number of latencies per bucket.
+ * @param fraction The percentile as a fraction.
+ * @return The upper bound in microseconds, or std::nullopt if there are fewer than hedge_samples latencies.
+ */
+template <typename T, std::size_t N>
+[[nodiscard]] constexpr std::optional<long long> percentile(const std::array<T, N>& histogram, double fraction) {
+    long long total = 0;
+    for (const auto& count : histogram)
+        total += count;
+    if (total < hedge_samples)
+        return std::nullopt;
+    long long seen = 0;
+    for (std::size_t bucket = 0; bucket < N; ++bucket)
+        if ((seen += histogram[bucket]) >= fraction * total)
+            return 1LL << bucket;
+    return 1LL << (N - 1);
+}
+
+/**
+ * Sorts ranges and merges the ones that overlap or touch.
+ * @param ranges The ranges.
+ * @return The disjoint ranges covering the same bytes, in ascending order.
+ */
+[[nodiscard]] constexpr std::vector<Range> merge(std::vector<Range> ranges) {
+    std::sort(ranges.begin(), ranges.end(), [](const Range& l, const Range& r) { return l.begin < r.begin; });
+    std::vector<Range> result;
+    for (const auto& range : ranges) {
+        if (range.size() <= 0)
+            continue;
+        if (!result.empty() && range.begin <= result.back().end)
+            result.back().end = std::max(result.back().end, range.end);
+        else
+            result.push_back(range);
+    }
+    return result;
+}
+
+/**
+ * The parts of a range that a set of ranges leaves out.
+ * @param whole The range.
+ * @param covered Disjoint ranges in ascending order, as returned by merge.
+ * @return The ranges of @p whole that are not covered, in ascending order.
+ */
+[[nodiscard]] constexpr std::vector<Range> uncovered(const Range& whole, const std::vector<Range>& covered) {
+    std::vector<Range> result;
+    long long position = whole.begin;
+    for (const auto& range : covered) {
+        if (range.begin > position)
+            result.push_back(Range{position, std::min(range.begin, whole.end)});
+        position = std::max(position, range.end);
+        if (position >= whole.end)
+            break;
+    }
+    if (position < whole.end)
+        result.push_back(Range{position, whole.end});
+    return merge(result);
+}
+
+/**
+ * The byte ranges of every file that scans have searched, so that a later run can continue where a cancelled one
+ * stopped.
+ */
+struct Coverage {
+    std::mutex mutex;                                /**< Guards #files. */
+    std::map<std::string, std::vector<Range>> files; /**< The searched ranges per path. */
+
+    /**
+     * Records a searched range.
+     * @param path Path of the file.
+     * @param range The searched range.
+     */
+    void add(const std::string& path, const Range& range) {
+        std::lock_guard<std::mutex> lock(mutex);
+        files[path].push_back(range);
+    }
+
+    /**
+     * The searched ranges of a file.
+     * @param path Path of the file.
+     * @return The disjoint ranges in ascending order.
+     */
+    [[nodiscard]] std::vector<Range> covered(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto it = files.find(path);
+        return it == files.end() ? std::vector<Range>{} : merge(it->second);
+    }
+};
+
+constexpr std::string_view coverage_magic = "minigrep coverage 1\n"; /**< The first line of a coverage report. */
+
+/**
+ * Saves a coverage report, one line of begin, end and path per searched range.
+ * @param path Path of the report.
+ * @param coverage The coverage to save.
+ * @return Whether the report was written.
+ */
+[[nodiscard]] bool save_coverage(const std::filesystem::path& path, Coverage& coverage) {
+    std::ofstream os(path);
+    os << coverage_magic;
+    std::lock_guard<std::mutex> lock(coverage.mutex);
+    for (const auto& [file, ranges] : coverage.files)
+        for (const auto& range : merge(ranges))
+            os << range.begin << ' ' << range.end << ' ' << file << '\n';
+    return static_cast<bool>(os);
+}
+
+/**
+ * Loads a coverage report into a coverage.
+ * @param path Path of the report.
+ * @param coverage The coverage to add the searched ranges to.
+ * @return Whether the file is a coverage report.
+ */
+[[nodiscard]] bool load_coverage(const std::filesystem::path& path, Coverage& coverage) {
+    std::ifstream is(path);
+    std::string line;
+    if (!std::getline(is, line) || line + '\n' != coverage_magic)
+        return false;
+    Range range{};
+    while (is >> range.begin >> range.end && is.get() == ' ' && std::getline(is, line))
+        coverage.add(line, range);
+    return is.eof();
+}
+
+constexpr int tail_size = 64; /**< The bytes before a mark whose fingerprint tells appends from rewrites. */
+
+/**
+ * Computes the FNV-1a hash of some bytes.
+ * @param bytes The bytes.
+ * @return The hash.
+ */
+[[nodiscard]] constexpr std::uint64_t fingerprint(std::string_view bytes) {
+    std::uint64_t hash = 14695981039346656037ull;
+    for (const char c : bytes)
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    return hash;
+}
+
+/**
+ * Fingerprints the bytes of a file just before an offset.
+ * @param path Path of the file.
+ * @param end The offset.
+ * @return The fingerprint of the tail_size bytes before the offset, or fewer at the start of the file, or std::nullopt
+ * if they could not be read.
+ */
+[[nodiscard]] std::optional<std::uint64_t> tail_fingerprint(const std::string& path, long long end) {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return std::nullopt;
+    std::array<char, tail_size> buffer;
+    const long long begin = std::max(end - tail_size, 0LL);
+    const ssize_t count = FileChunk::pread_all(fd, buffer.data(), end - begin, begin);
+    ::close(fd);
+    if (count != end - begin)
+        return std::nullopt;
+    return fingerprint(std::string_view(buffer.data(), count));
+}
+
+/**
+ * How far an append-only file was searched.
+ */
+struct Mark {
+    unsigned long long inode; /**< The inode of the file when it was searched. */
+    long long size;           /**< The size the file was searched up to. */
+    long long overlap;        /**< The bytes before the end that a match could start in without fitting. */
+    std::uint64_t tail;       /**< The fingerprint of the bytes before the end. */
+};
+
+/**
+ * The range of a file left to search after a previous search up to its mark. A match that starts within the overlap
+ * before the old end was cut off by it, so that much is searched again; anything before it was reported already.
+ * A different inode means the file was rotated, and a smaller size or different bytes before the mark that it was
+ * truncated and written again; such files are searched whole.
+ * @param mark The mark of the previous search.
+ * @param inode The inode of the file now.
+ * @param size The size of the file now.
+ * @param tail The fingerprint of the bytes before the mark now, if they could be read.
+ * @return The range to search.
+ */
+[[nodiscard]] constexpr Range delta(const Mark& mark, unsigned long long inode, long long size,
+                                    std::optional<std::uint64_t> tail) {
+    if (mark.inode != inode || size < mark.size || tail != mark.tail)
+        return Range{0, size};
+    return Range{std::max(mark.size - mark.overlap, 0LL), size};
+}
+
+/**
+ * The marks of the files searched for one string, so that the next search for it reads only what was appended since.
+ */
+struct Marks {
+    std::string needle;                  /**< The string searched for. */
+    std::mutex mutex;                    /**< Guards #files. */
+    std::map<std::string, Mark> files;   /**< The mark per path. */
+    std::map<std::string, Mark> updated; /**< The marks of the files searched in this run, per path. */
+
+    /**
+     * The range of a file left to search, recording that the file is searched up to its current size.
+     * @param file The file.
+     * @return The range to search.
+     */
+    [[nodiscard]] Range search(const File& file) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto overlap = std::max(static_cast<long long>(needle.size()) - 1, 0LL);
+        updated[file.path] = Mark{file.inode, file.size, overlap, tail_fingerprint(file.path, file.size).value_or(0)};
+        const auto it = files.find(file.path);
+        if (it == files.end())
+            return Range{0, file.size};
+        const auto& mark = it->second;
+        return delta(mark, file.inode, file.size,
+                     mark.size <= file.size ? tail_fingerprint(file.path, mark.size) : std::nullopt);
+    }
+};
+
+constexpr std::string_view marks_magic = "minigrep marks 1\n"; /**< The first line of a state file. */
+
+/**
+ * Saves the marks of the previous run updated with those of this one: the size of the needle and the needle, then one
+ * line of inode, size, overlap, tail fingerprint and path per file.
+ * @param path Path of the state file.
+ * @param marks The marks to save.
+ * @return Whether the state file was written.
+ */
+[[nodiscard]] bool save_marks(const std::filesystem::path& path, Marks& marks) {
+    std::ofstream os(path);
+    os << marks_magic << marks.needle.size() << ' ' << marks.needle << '\n';
+    std::lock_guard<std::mutex> lock(marks.mutex);
+    auto all = marks.updated;
+    all.insert(marks.files.begin(), marks.files.end()); // files the plan skipped keep their marks
+    for (const auto& [file, mark] : all)
+        os << mark.inode << ' ' << mark.size << ' ' << mark.overlap << ' ' << mark.tail << ' ' << file << '\n';
+    return static_cast<bool>(os);
+}
+
+/**
+ * Loads the marks of a state file if they were recorded for the same needle, so that a search for another string
+ * starts from scratch.
+ * @param path Path of the state file.
+ * @param marks The marks to load into, whose needle is set.
+ * @return Whether the file is a state file.
+ */
+[[nodiscard]] bool load_marks(const std::filesystem::path& path, Marks& marks) {
+    std::ifstream is(path);
+    std::string line;
+    std::size_t size = 0;
+    if (!std::getline(is, line) || line + '\n' != marks_magic || !(is >> size) || is.get() != ' ')
+        return false;
+    std::string needle(size, '\0');
+    if (!is.read(needle.data(), size) || is.get() != '\n')
+        return false;
+    Mark mark{};
+    while (is >> mark.inode >> mark.size >> mark.overlap >> mark.tail && is.get() == ' ' && std::getline(is, line))
+        if (needle == marks.needle)
+            marks.files[line] = mark;
+    return is.eof();
+}
+
+/**
+ * Orders matches by path and then by position.
+ * @param l left hand side
+ * @param r right hand side
+ * @return Whether the left match comes first.
+ */
+[[nodiscard]] bool operator<(const Match& l, const Match& r) {
+    return std::tie(l.path, l.position) < std::tie(r.path, r.position);
+}
+
+/**
+ * Writes a match to a run in binary form.
+ * @param os The run.
+ * @param match The match.
+ */
+void write_match(std::ostream& os, const Match& match) {
+    auto write = [&](const auto& value) { os.write(reinterpret_cast<const char*>(&value), sizeof(value)); };
+    for (const auto* text : {&match.path, &match.prefix, &match.suffix}) {
+        write(static_cast<std::uint32_t>(text->size()));
+        os << *text;
+    }
+    write(match.position);
+}
+
+/**
+ * Reads a match that write_match wrote to a run.
+ * @param is The run.
+ * @return The match, or std::nullopt at the end of the run.
+ */
+[[nodiscard]] std::optional<Match> read_match(std::istream& is) {
+    auto read = [&](auto& value) { return static_cast<bool>(is.read(reinterpret_cast<char*>(&value), sizeof(value))); };
+    Match match{};
+    for (auto* text : {&match.path, &match.prefix, &match.suffix}) {
+        std::uint32_t size = 0;
+        if (!read(size))
+            return std::nullopt;
+        text->resize(size);
+        if (!is.read(text->data(), size))
+            return std::nullopt;
+    }
+    return read(match.position) ? std::optional(std::move(match)) : std::nullopt;
+}
+
+/**
+ * Sorts the matches of a scan whatever their number. Every worker collects matches in a buffer of its own, which is
+ * sorted and spilled to a run in a temporary directory once it outgrows its share of the memory. At the end the runs
+ * are merged, first in passes that merge groups of at most `sort_fanin` runs on several threads at once, and then in
+ * a final merge straight to the output. If nothing was spilled, the buffers are merged in memory.
+ */
+struct Sorter {
+    /**
+     * The matches one worker collected since its last spill.
+     */
+    struct Buffer {
+        std::vector<Match> matches; /**< The matches. */
+        long long bytes = 0;        /**< The memory the matches take up, roughly. */
+    };
+
+    long long limit;                                            /**< The memory each buffer may take up. */
+    int fanin;                                                  /**< The number of runs merged at once. */
+    int threads;                                                /**< The number of merges run at once. */
+    std::filesystem::path directory;                            /**< Where the runs are spilled, once needed. */
+    std::mutex mutex;                                           /**< Guards the members below. */
+    std::map<std::thread::id, std::shared_ptr<Buffer>> buffers; /**< The buffer of every worker. */
+    std::vector<std::filesystem::path> runs;                    /**< The runs spilled so far. */
+    std::size_t named = 0;                                      /**< The number of runs named so far. */
+    bool failed = false;                                        /**< Whether a run could not be written. */
+
+    /**
+     * Constructs a sorter.
+     * @param memory The memory all buffers may take up together.
+     * @param workers The number of workers that collect matches.
+     * @param fanin The number of runs merged at once.
+     */
+    Sorter(long long memory, int workers, int fanin)
+        : limit(std::max(memory / std::max(workers, 1), 1LL)), fanin(std::max(fanin, 2)), threads(workers) {}
+
+    Sorter(const Sorter&) = delete;
+    Sorter& operator=(const Sorter&) = delete;
+
+    /**
+     * Removes the runs and their directory.
+     */
+    ~Sorter() {
+        std::error_code error;
+        if (!directory.empty())
+            std::filesystem::remove_all(directory, error);
+    }
+
+    /**
+     * Adds matches to the buffer of the calling worker, spilling it if it grew too large.
+     * @param matches The matches.
+     */
+    void add(std::vector<Match> matches) {
+        std::shared_ptr<Buffer> buffer;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto& slot = buffers[std::this_thread::get_id()];
+            buffer = slot ? slot : (slot = std::make_shared<Buffer>());
+        }
+        for (auto& match : matches) {
+            buffer->bytes += sizeof(Match) + match.path.size() + match.prefix.size() + match.suffix.size();
+            buffer->matches.push_back(std::move(match));
+        }
+        if (buffer->bytes > limit)
+            spill(*buffer);
+    }
+
+    /**
+     * Sorts a buffer and writes it to a new run.
+     * @param buffer The buffer, empty afterwards.
+     */
+    void spill(Buffer& buffer) {
+        std::sort(buffer.matches.begin(), buffer.matches.end());
+        const auto path = next_run();
+        std::ofstream os(path, std::ios::binary);
+        for (const auto& match : buffer.matches)
+            write_match(os, match);
+        if (!os) {
+            std::lock_guard<std::mutex> lock(mutex);
+            failed = true;
+        }
+        buffer = Buffer{};
+    }
+
+    /**
+     * Names a new run, creating the temporary directory on first use.
+     * @return Path of the run.
+     */
+    [[nodiscard]] std::filesystem::path next_run() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (directory.empty()) {
+            auto name = (std::filesystem::temp_directory_path() / "minigrep-XXXXXX").string();
+            if (::mkdtemp(name.data()))
+                directory = name;
+            else
+                directory = std::filesystem::temp_directory_path(), failed = true;
+        }
+        // never reuse a name, as a merge pass still reads its inputs while it names its outputs
+        runs.push_back(directory / ("run" + std::to_string(named++)));
+        return runs.back();
+    }
+
+    /**
+     * Merges sorted runs.
+     * @param inputs Paths of the runs.
+     * @param os Stream to write to.
+     * @param print Whether to print the matches as text instead of writing them as a run.
+     */
+    static void merge(const std::vector<std::filesystem::path>& inputs, std::ostream& os, bool print) {
+        std::vector<std::ifstream> streams;
+        using Head = std::pair<Match, std::size_t>;
+        auto later = [](const Head& l, const Head& r) { return r.first < l.first; };
+        std::priority_queue<Head, std::vector<Head>, decltype(later)> heads(later);
+        for (const auto& input : inputs)
+            streams.emplace_back(input, std::ios::binary);
+        for (std::size_t i = 0; i < streams.size(); ++i)
+            if (auto match = read_match(streams[i]))
+                heads.emplace(std::move(match.value()), i);
+        while (!heads.empty()) {
+            auto [match, i] = heads.top();
+            heads.pop();
+            if (print)
+                os << match << "\n";
+            else
+                write_match(os, match);
+            if (auto next = read_match(streams[i]))
+                heads.emplace(std::move(next.value()), i);
+        }
+    }
+
+    /**
+     * Prints all matches in order.
+     * @param os Stream to print the matches to.
+     * @return Whether every run could be written.
+     */
+    [[nodiscard]] bool finish(std::ostream& os) {
+        if (runs.empty()) {
+            std::vector<Match> all;
+            for (auto& [id, buffer] : buffers)
+                std::move(buffer->matches.begin(), buffer->matches.end(), std::back_inserter(all));
+            std::sort(all.begin(), all.end());
+            for (const auto& match : all)
+                os << match << "\n";
+            return true;
+        }
+        for (auto& [id, buffer] : buffers)
+            if (!buffer->matches.empty())
+                spill(*buffer);
+        while (static_cast<int>(runs.size()) > fanin) {
+            // one pass: groups of fanin runs become one run each, several groups at a time
+            std::vector<std::filesystem::path> inputs;
+            std::swap(inputs, runs);
+            std::vector<std::pair<std::vector<std::filesystem::path>, std::filesystem::path>> groups;
+            for (std::size_t i = 0; i < inputs.size(); i += fanin) {
+                const auto end = inputs.begin() + std::min<std::size_t>(inputs.size(), i + fanin);
+                groups.emplace_back(std::vector(inputs.begin() + i, end), next_run());
+            }
+            std::atomic<std::size_t> next = 0;
+            std::vector<std::jthread> mergers;
+            for (int t = 0; t < std::max(threads, 1); ++t) {
+                mergers.emplace_back([&] {
+                    for (std::size_t g; (g = next++) < groups.size();) {
+                        std::ofstream run(groups[g].second, std::ios::binary);
+                        merge(groups[g].first, run, false);
+                        bool removed = true;
+                        for (const auto& input : groups[g].first) {
+                            std::error_code error;
+                            removed &= std::filesystem::remove(input, error) || !error;
+                        }
+                        if (!run || !removed) {
+                            std::lock_guard<std::mutex> lock(mutex);
+                            failed = true;
+                        }
+                    }
+                });
+            }
+        }
+        merge(runs, os, true);
+        return !failed;
+    }
+};
+
+/**
+ * Writes the output of the chunks to a file from all workers at once. Each chunk formats its matches first, and the
+ * prefix sum of the sizes of the chunks before it gives the offset that the worker writes them to with pwrite. When
+ * ordered, a chunk that finishes before the ones ahead of it waits in memory until their sizes are known, and the
+ * worker that completes the prefix writes it, so the file is the same whatever order the chunks finish in. Unordered
+ * output reserves the offsets in the order the chunks finish.
+ */
+struct Output {
+    int fd;                                     /**< The output file. */
+    bool ordered;                               /**< Whether the chunks are written in the order of their sequence. */
+    std::mutex mutex;                           /**< Guards the members below. */
+    std::map<std::size_t, std::string> pending; /**< The output of chunks whose offset is not known yet. */
+    std::size_t next = 0;                       /**< The sequence of the first chunk without an offset. */
+    long long size = 0;                         /**< The offset of the next chunk, the size written so far. */
+    bool failed = false;                        /**< Whether a write failed. */
+
+    /**
+     * Creates or truncates the output file.
+     * @param path Path of the file.
+     * @param ordered Whether to write the chunks in the order of their sequence.
+     */
+    Output(const std::filesystem::path& path, bool ordered)
+        : fd(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666)), ordered(ordered) {}
+
+    Output(const Output&) = delete;
+    Output& operator=(const Output&) = delete;
+
+    /**
+     * Closes the file.
+     */
+    ~Output() {
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    /**
+     * Writes the output of a chunk, along with those after it that were waiting for it.
+     * @param sequence The position of the chunk in the output.
+     * @param text The formatted matches of the chunk, empty if it has none or was skipped.
+     */
+    void write(std::size_t sequence, std::string text) {
+        std::vector<std::pair<long long, std::string>> ready; // the outputs whose offsets are known now
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!ordered) {
+                ready.emplace_back(size, std::move(text));
+                size += ready.back().second.size();
+            } else {
+                pending.emplace(sequence, std::move(text));
+                for (auto it = pending.begin(); it != pending.end() && it->first == next; it = pending.erase(it)) {
+                    ready.emplace_back(size, std::move(it->second));
+                    size += ready.back().second.size();
+                    ++next;
+                }
+            }
+        }
+        put(ready);
+    }
+
+    /**
+     * Writes the chunks still waiting for ones that were never searched, as when a scan is cancelled.
+     * @return Whether every write succeeded.
+     */
+    [[nodiscard]] bool finish() {
+        std::vector<std::pair<long long, std::string>> ready;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto& [sequence, text] : pending) {
+                ready.emplace_back(size, std::move(text));
+                size += ready.back().second.size();
+            }
+            pending.clear();
+        }
+        put(ready);
+        std::lock_guard<std::mutex> lock(mutex);
+        return fd >= 0 && !failed;
+    }
+
+  private:
+    /**
+     * Writes outputs at their offsets.
+     * @param ready The offsets and the outputs to write there.
+     */
+    void put(const std::vector<std::pair<long long, std::string>>& ready) {
+        for (const auto& [offset, output] : ready) {
+            for (std::size_t done = 0; done < output.size();) {
+                const ssize_t n = ::pwrite(fd, output.data() + done, output.size() - done, offset + done);
+                MINIGREP_PROBE2(output_flush, offset + done, n);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    failed = true;
+                    break;
+                }
+                done += n;
+            }
+        }
+    }
+};
+
+/**
+ * The matches of a scan grouped by file.
+ */
+struct Results {
+    std::mutex mutex;                                /**< Guards #files. */
+    std::map<std::string, std::vector<Match>> files; /**< The matches per path, in the order they were found. */
+
+    /**
+     * Records the matches of a chunk.
+     * @param matches The matches.
+     */
+    void add(std::vector<Match> matches) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& match : matches)
+            files[match.path].push_back(std::move(match));
+    }
+};
+
+/**
+ * The CPU time the calling thread has spent so far.
+ * @return The CPU time.
+ */
+[[nodiscard]] std::chrono::nanoseconds thread_cpu() {
+    timespec time{};
+    ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+    return std::chrono::seconds(time.tv_sec) + std::chrono::nanoseconds(time.tv_nsec);
+}
+
+/**
+ * What searching each file cost, to find the few files that make a scan slow.
+ * Every thread adds up the costs of its chunks in a map of its own, so workers do not contend, and the maps are only
+ * merged once the scan is over.
+ */
+struct Costs {
+    /**
+     * The cost of a file, summed over its chunks.
+     */
+    struct Cost {
+        std::chrono::nanoseconds wall{};    /**< The time spent reading and searching. */
+        std::chrono::nanoseconds io_wait{}; /**< The part of the reading time that was not spent on the CPU. */
+        std::chrono::nanoseconds cpu{};     /**< The CPU time spent reading and searching. */
+        long long bytes = 0;                /**< The number of bytes read. */
+        long long matches = 0;              /**< The number of matches found. */
+    };
+
+    using Files = std::unordered_map<std::string, Cost>; /**< The costs by path. */
+
+    /**
+     * The ways to rank files, with their names.
+     */
+    static constexpr std::array<std::pair<std::string_view, double (*)(const Cost&)>, 5> rankings{{
+        {"wall time", [](const Cost& cost) { return std::chrono::duration<double>(cost.wall).count(); }},
+        {"bytes", [](const Cost& cost) { return static_cast<double>(cost.bytes); }},
+        {"matches", [](const Cost& cost) { return static_cast<double>(cost.matches); }},
+        {"io wait", [](const Cost& cost) { return std::chrono::duration<double>(cost.io_wait).count(); }},
+        {"cpu time", [](const Cost& cost) { return std::chrono::duration<double>(cost.cpu).count(); }},
+    }};
+
+    const unsigned long long id = next_id++; /**< Tells the costs apart from earlier ones at the same address. */
+    std::mutex mutex;                         /**< Guards #threads. */
+    std::vector<std::unique_ptr<Files>> threads; /**< The costs collected by every thread that searched. */
+
+    /**
+     * The costs collected by the calling thread, registered on its first chunk.
+     * @return The costs.
+     */
+    [[nodiscard]] Files& local() {
+        thread_local std::pair<unsigned long long, Files*> current{0, nullptr};
+        if (current.first != id) {
+            std::lock_guard<std::mutex> lock(mutex);
+            current = {id, threads.emplace_back(std::make_unique<Files>()).get()};
+        }
+        return *current.second;
+    }
+
+    /**
+     * Merges the costs of all threads, which must have stopped adding to them.
+     * @return The costs by path.
+     */
+    [[nodiscard]] Files merged() {
+        std::lock_guard<std::mutex> lock(mutex);
+        Files result;
+        for (const auto& files : threads)
+            for (const auto& [path, cost] : *files) {
+                auto& sum = result[path];
+                sum.wall += cost.wall;
+                sum.io_wait += cost.io_wait;
+                sum.cpu += cost.cpu;
+                sum.bytes += cost.bytes;
+                sum.matches += cost.matches;
+            }
+        return result;
+    }
+
+    /**
+     * Prints the most costly files by every ranking.
+     * @param os The stream to print to.
+     * @param count The number of files to print per ranking.
+     */
+    void print(std::ostream& os, std::size_t count) {
+        const auto files = merged();
+        std::vector<std::pair<std::string_view, Cost>> ranked;
+        for (const auto& [path, cost] : files)
+            ranked.emplace_back(path, cost);
+        auto us = [](std::chrono::nanoseconds time) {
+            return std::chrono::duration_cast<std::chrono::microseconds>(time).count();
+        };
+        for (const auto& [name, rank] : rankings) {
+            const std::size_t top = std::min(count, ranked.size());
+            std::partial_sort(ranked.begin(), ranked.begin() + top, ranked.end(), [&](const auto& a, const auto& b) {
+                return rank(a.second) > rank(b.second) || (rank(a.second) == rank(b.second) && a.first < b.first);
+            });
+            os << "files by " << name << ": wall us, io wait us, cpu us, bytes, matches, path\n";
+            for (std::size_t i = 0; i < top; ++i) {
+                const auto& [path, cost] = ranked[i];
+                os << "  " << us(cost.wall) << " " << us(cost.io_wait) << " " << us(cost.cpu) << " " << cost.bytes
+                   << " " << cost.matches << " " << path << "\n";
+            }
+        }
+    }
+
+  private:
+    static inline std::atomic<unsigned long long> next_id = 1; /**< The id of the next costs. */
+};
+
+/**
+ * Searches the fetched chunk for matches and prints them, or hands them to a sorter, an output file or results.
+ * With costs, the time spent on the chunk and the time its read took are added to its file.
+ * @param chunk Chunk to be searched.
+ * @param searcher String to search for.
+ * @param os Stream to print the matches to.
+ * @param stats Counters to update.
+ * @param sorter The sorter to hand the matches to instead, or nullptr.
+ * @param output The output file to write the matches to instead, or nullptr.
+ * @param results The results to record the matches in instead, or nullptr.
+ * @param costs The costs to add the chunk to, or nullptr.
+ */
+void search(FileChunk& chunk, const Searcher& searcher, std::ostream& os, Stats& stats, Sorter* sorter = nullptr,
+            Output* output = nullptr, Results* results = nullptr, Costs* costs = nullptr) {
+    const auto started = costs ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{};
+    const auto started_cpu = costs ? thread_cpu() : std::chrono::nanoseconds{};
+    auto all_matches = matches(chunk, searcher);
+    if (costs) { // before the output, which waits for other workers
+        auto& cost = costs->local()[chunk.file.path];
+        cost.wall += chunk.fetch_time + (std::chrono::steady_clock::now() - started);
+        cost.io_wait += std::max(chunk.fetch_time - chunk.fetch_cpu, std::chrono::nanoseconds{});
+        cost.cpu += chunk.fetch_cpu + (thread_cpu() - started_cpu);
+        cost.bytes += chunk.contents.size();
+        cost.matches += all_matches.size();
+    }
+    stats.io_chunks[static_cast<int>(chunk.file.io)]++;
+    stats.filesystem_chunks[static_cast<int>(chunk.file.filesystem)]++;
+    stats.io_bytes[static_cast<int>(chunk.file.io)] += chunk.contents.size();
+    chunk.release();
+    stats.chunks++;
+    stats.bytes += chunk.search.size();
+    stats.matches += all_matches.size();
+    if (sorter) {
+        sorter->add(std::move(all_matches));
+        return;
+    }
+    if (results) {
+        results->add(std::move(all_matches));
+        return;
+    }
+    if (output) {
+        std::ostringstream text;
+        for (const auto& match : all_matches)
+            text << match << "\n";
+        output->write(chunk.sequence, std::move(text).str());
+        return;
+    }
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto& match : all_matches)
+        os << match << "\n";
+    if (!all_matches.empty()) {
+        os.flush(); // hits reach a pipe as they are found, not when the buffer fills
+        MINIGREP_PROBE2(output_flush, -1, static_cast<long long>(all_matches.size()));
+    }
+}
+
+/**
+ * State of the hill climbing that adjusts the number of active workers to the measured throughput.
+ */
+struct Climb {
+    int workers;       /**< The number of active workers. */
+    int direction;     /**< 1 if the next step adds workers, -1 if it removes them. */
+    double throughput; /**< The throughput measured in the previous window. */
+
+    /**
+     * Takes one step, turning around if the last one lowered the throughput by more than the noise.
+     * @param throughput The throughput measured in the window after the last step.
+     * @param max_workers The maximum number of active workers.
+     * @return The state after the step.
+     */
+    [[nodiscard]] constexpr Climb step(double throughput, int max_workers) const {
+        const int turn = throughput < this->throughput * (1 - climb_tolerance) ? -direction : direction;
+        const int next = std::clamp(workers + turn * std::max(1, workers / 8), 1, max_workers);
+        return Climb{next, next == workers ? -turn : turn, throughput}; // bounce off the limits
+    }
+};
+
+/**
+ * Checks two climbing states for equality.
+ * @param l left hand side
+ * @param r right hand side
+ * @return Whether the states are equal.
+ */
+[[nodiscard]] constexpr bool operator==(const Climb& l, const Climb& r) {
+    return l.workers == r.workers && l.direction == r.direction && l.throughput == r.throughput;
+}
+
+/**
+ * Admits only the first few workers to take chunks, the rest wait until the limit is raised.
+ */
+struct Gate {
+    std::atomic<int> active;    /**< The number of workers that may take chunks. */
+    std::atomic<int> left = 0;  /**< The number of workers that left, whose places the waiting ones take. */
+    bool open = false;          /**< Whether every worker is let through, set once the search is cancelled. */
+    std::mutex mutex;           /**< Guards #open and the waiting. */
+    std::condition_variable cv; /**< Wakes waiting workers. */
+
+    /**
+     * Constructs a gate.
+     * @param active The number of workers that may take chunks.
+     */
+    explicit Gate(int active) : active(active) {}
+
+    /**
+     * Blocks the worker while it is above the limit.
+     * @param worker The index of the worker.
+     */
+    void enter(int worker) {
+        auto admitted = [&] { return worker < active.load(std::memory_order_relaxed) + left.load(); };
+        if (admitted())
+            return;
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return open || admitted(); });
+    }
+
+    /**
+     * Changes the limit.
+     * @param workers The number of workers that may take chunks.
+     */
+    void resize(int workers) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            active = workers;
+        }
+        cv.notify_all();
+    }
+
+    /**
+     * Hands the place of a worker that found no work left to the waiting worker with the lowest index, as the limit
+     * admits by index, which finds out for itself. Every waiting worker wakes to check whether it is that one.
+     */
+    void leave() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            left++;
+        }
+        cv.notify_all();
+    }
+
+    /**
+     * Lets every worker through so that the waiting ones can see that the search was cancelled.
+     */
+    void release() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            open = true;
+        }
+        cv.notify_all();
+    }
+};
+
+/**
+ * Extracts the total stall time from a line of a pressure file.
+ * @param line A line such as "some avg10=0.00 avg60=0.00 avg300=0.00 total=1234".
+ * @return The total time in microseconds that some task stalled, or std::nullopt if the line does not contain it.
+ */
+[[nodiscard]] constexpr std::optional<long long> stall_total(std::string_view line) {
+    constexpr std::string_view key = " total=";
+    const auto pos = line.find(key);
+    if (!line.starts_with("some ") || pos == std::string_view::npos)
+        return std::nullopt;
+    long long total = 0;
+    for (const auto& c : line.substr(pos + key.size())) {
+        if (c < '0' || c > '9')
+            break;
+        total = total * 10 + (c - '0');
+    }
+    return total;
+}
+
+/**
+ * Shrinks the number of active workers while the system is under pressure and grows it back once it clears.
+ * @param cap The current limit on the number of active workers.
+ * @param stall The fraction of the last window in which some task stalled.
+ * @param threshold The stall percentage from which to back off.
+ * @param max_workers The maximum number of active workers.
+ * @return The new limit, halved under pressure and raised by one when the pressure is below half the threshold.
+ */
+[[nodiscard]] constexpr int throttle(int cap, double stall, int threshold, int max_workers) {
+    if (stall * 100 >= threshold)
+        return std::max(1, cap / 2);
+    if (stall * 100 < threshold / 2.0)
+        return std::min(max_workers, cap + 1);
+    return cap;
+}
+
+/**
+ * Pressure stall information of the host, or of the cgroup if the host does not expose it.
+ */
+struct Pressure {
+    std::vector<std::filesystem::path> files; /**< The cpu, io and memory pressure files that exist. */
+    std::vector<long long> totals;            /**< The stall totals at the last sample. */
+
+    /**
+     * Finds the pressure files and takes the first sample.
+     */
+    Pressure() {
+        std::vector<std::filesystem::path> directories{"/proc/pressure"};
+        std::ifstream cgroups("/proc/self/cgroup");
+        for (std::string line; std::getline(cgroups, line);)
+            if (line.starts_with("0::")) // cgroup v2, mounted either directly or in hybrid mode
+                for (const auto* root : {"/sys/fs/cgroup", "/sys/fs/cgroup/unified"})
+                    directories.push_back(std::filesystem::path(root) / std::string_view(line).substr(4));
+        for (const auto& directory : directories) {
+            for (const auto* name : {"cpu", "io", "memory"}) {
+                const auto path = directory / (directory == "/proc/pressure" ? name : std::string(name) + ".pressure");
+                if (std::ifstream(path))
+                    files.push_back(path);
+            }
+            if (!files.empty())
+                break;
+        }
+        totals = read();
+    }
+
+    /**
+     * Reads the stall totals.
+     * @return The stall totals in microseconds, in the order of #files.
+     */
+    [[nodiscard]] std::vector<long long> read() const {
+        std::vector<long long> result;
+        for (const auto& path : files) {
+            std::ifstream is(path);
+            std::string line;
+            std::getline(is, line);
+            result.push_back(stall_total(line).value_or(0));
+        }
+        return result;
+    }
+
+    /**
+     * Measures the pressure since the last sample.
+     * @param elapsed The time since the last sample in seconds.
+     * @return The largest fraction of the elapsed time in which some task stalled on a resource.
+     */
+    [[nodiscard]] double sample(double elapsed) {
+        auto next = read();
+        double result = 0;
+        for (std::size_t i = 0; i < next.size(); ++i)
+            result = std::max(result, (next[i] - totals[i]) / (elapsed * 1e6));
+        totals = std::move(next);
+        return result;
+    }
+};
+
+/**
+ * A read in flight, shared between the worker doing it and the watchdog. A worker that is abandoned while stuck in a
+ * read only ever touches this object afterwards, so the read may outlive the scan.
+ */
+struct Read {
+    enum State { in_flight, done, abandoned };
+
+    FileChunk chunk;                               /**< A copy of the chunk, which the worker reads into. */
+    const FileChunk request;                       /**< The chunk as it was before the read, to copy for hedging. */
+    std::shared_ptr<std::atomic<bool>> claimed;    /**< Set by the first read of the chunk to finish, or on timeout. */
+    bool hedge = false;                            /**< Whether this read duplicates a slow one. */
+    bool hedged = false;                           /**< Whether a duplicate of this read was issued. */
+    bool cold = false;                             /**< Whether this read holds a slot of the I/O queue. */
+    std::chrono::steady_clock::time_point started; /**< When the read was issued. */
+    std::atomic<State> state = in_flight;          /**< Whether the worker or the watchdog gave up on it first. */
+
+    /**
+     * Constructs a read.
+     * @param chunk The chunk to be read.
+     * @param claimed The flag shared by all reads of the chunk.
+     * @param hedge Whether this read duplicates a slow one.
+     */
+    Read(const FileChunk& chunk, std::shared_ptr<std::atomic<bool>> claimed, bool hedge)
+        : chunk(chunk), request(chunk), claimed(std::move(claimed)), hedge(hedge) {}
+};
+
+/**
+ * Chunks that the traversal hands to a running scan, which takes them best priority first. Chunks of the same
+ * priority are taken in the order they were fed, so a file is still read front to back.
+ */
+struct Feed {
+    /**
+     * A chunk waiting in the feed.
+     */
+    struct Item {
+        long long priority; /**< Lower is taken first. */
+        long long sequence; /**< The position at which the chunk was fed. */
+        FileChunk chunk;    /**< The chunk. */
+
+        /**
+         * Orders items so that the priority queue puts the best one on top.
+         * @param other The item to compare with.
+         * @return Whether this item is taken after the other one.
+         */
+        [[nodiscard]] bool operator<(const Item& other) const {
+            return std::tie(priority, sequence) > std::tie(other.priority, other.sequence);
+        }
+    };
+
+    std::mutex mutex;                /**< Guards the members below. */
+    std::condition_variable cv;      /**< Wakes workers waiting for chunks. */
+    std::priority_queue<Item> items; /**< The chunks not taken yet. */
+    long long sequence = 0;          /**< The number of chunks fed so far. */
+    bool closed = false;             /**< Whether the traversal has finished. */
+
+    /**
+     * Adds the chunks of a file.
+     * @param chunks The chunks.
+     * @param priority The priority of the file, lower is taken first.
+     */
+    void push(const std::vector<FileChunk>& chunks, long long priority) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (const auto& chunk : chunks)
+                items.push(Item{priority, sequence++, chunk});
+        }
+        cv.notify_all();
+    }
+
+    /**
+     * Marks the end of the traversal.
+     */
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+        cv.notify_all();
+    }
+
+    /**
+     * Takes the best chunk, waiting for the traversal if there is none yet.
+     * @return The chunk, or std::nullopt once the traversal has finished and every chunk was taken.
+     */
+    [[nodiscard]] std::optional<FileChunk> pop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return closed || !items.empty(); });
+        if (items.empty())
+            return std::nullopt;
+        auto result = items.top().chunk;
+        items.pop();
+        return result;
+    }
+};
+
+/**
+ * Where an idle worker splits the rest of a range that it steals half of.
+ * @param rest The part of the range that its owner has not read yet.
+ * @param min_size The size up to which the owner may as well read the rest itself.
+ * @return The page aligned middle, or std::nullopt if the rest is not worth splitting.
+ */
+[[nodiscard]] constexpr std::optional<long long> steal_point(const Range& rest, long long min_size) {
+    const long long middle = (rest.begin + rest.size() / 2) / page_size * page_size;
+    if (rest.size() <= min_size || middle <= rest.begin)
+        return std::nullopt;
+    return middle;
+};
+
+/**
+ * How a scan hands out its work, and what it does besides searching.
+ */
+struct Schedule {
+    std::ostream* trace = nullptr; /**< Stream to log the decisions of the control loop to, or nullptr. */
+    bool hedge = false;            /**< Whether to hedge slow reads. */
+    bool lazy = false;             /**< Whether chunks are cut into reads as they are searched, and split on steal. */
+    Feed* feed = nullptr;          /**< The feed to take chunks from once the given ones are used up, or nullptr. */
+    std::function<std::optional<std::vector<FileChunk>>()> source; /**< Produces the chunks of the next file. */
+    Coverage* coverage = nullptr;  /**< Where to record the searched ranges, or nullptr. */
+    Sorter* sorter = nullptr;      /**< The sorter to hand the matches to instead of printing them, or nullptr. */
+    Output* output = nullptr;      /**< The file to write the matches to instead of printing them, or nullptr. */
+    Results* results = nullptr;    /**< Where to record the matches instead of printing them, or nullptr. */
+    Costs* costs = nullptr;        /**< Where to add up what each file cost, or nullptr. */
+    std::optional<std::chrono::steady_clock::time_point> deadline; /**< When to stop taking chunks, if ever. */
+};
+
+/**
+ * Searches all chunks, adjusting the number of active workers to the throughput measured over short windows.
+ * The workers are throttled further while the system reports pressure stalls, and the reads in flight on each kind of
+ * filesystem are limited to its queue depth. Chunks in the page cache form a CPU queue and cold ones an I/O queue
+ * of bounded depth: a worker starts a cold read whenever the I/O queue has room and searches cached chunks
+ * otherwise, so the disk and the cores are kept busy at the same time and cached results come out first. The calling
+ * thread acts as a watchdog: reads that exceed the timeout are skipped and reported, and their worker is replaced so
+ * that a hung mount cannot stall the scan. With hedging, reads slower than the 99th percentile are issued again and
+ * whichever copy finishes first is searched.
+ * When splitting lazily, each worker owns a chunk and reads it front to back, and a worker that runs out of chunks
+ * steals the back half of the largest rest another worker owns. Large files are read sequentially while the workers
+ * are busy and split finer only as they become idle. Matches stay intact at the split point, as the read range of
+ * every chunk extends by the length of the needle past its search range.
+ * With a source, the chunks of one file after another are made once the given ones are used up, so that a large
+ * tree is never held in memory as chunks. With a feed, the chunks come from a traversal that runs alongside the scan,
+ * best priority first. Both are taken in order, cold chunks waiting for room in the I/O queue.
+ * Once the deadline passes, the workers finish the chunk they are searching and take no more, cancelling the scan.
+ * With an output file, the matches are written in the order of the given chunks.
+ * @param chunks Chunks to be searched.
+ * @param searcher String to search for.
+ * @param tuning The number of workers and the parameters of the control loop.
+ * @param os Stream to print the matches to.
+ * @param stats Counters to update.
+ * @param schedule How to hand out the chunks.
+ */
+void scan(std::vector<FileChunk>& chunks, const Searcher& searcher, const Tuning& tuning, std::ostream& os,
+          Stats& stats, const Schedule& schedule = {}) {
+    const auto& [trace, hedge, lazy, feed, source, coverage, sorter, output, results, costs, deadline] = schedule;
+    const int max_workers = std::max(tuning.max_workers, 1);
+    Gate gate(std::clamp(tuning.workers, 1, max_workers));
+    std::array<std::unique_ptr<std::counting_semaphore<>>, filesystem_names.size()> queues;
+    for (std::size_t i = 0; i < queues.size(); ++i) {
+        const int depth = tuning.io_profile(static_cast<Filesystem>(i)).queue_depth;
+        queues[i] = std::make_unique<std::counting_semaphore<>>(depth);
+    }
+    std::vector<std::size_t> cached, cold; // the CPU queue and the I/O queue
+    for (std::size_t i = 0; i < chunks.size(); ++i) {
+        chunks[i].sequence = i;
+        (chunks[i].cold ? cold : cached).push_back(i);
+    }
+    std::counting_semaphore<> io_slots(std::max(tuning.io_depth, 1));
+    std::atomic<std::size_t> next_cached = 0, next_cold = 0;
+    std::mutex source_mutex;                   // guards the variables below
+    std::queue<FileChunk> sourced;             // the chunks of the file the source produced last
+    std::size_t next_sequence = chunks.size(); // the position of the next sourced chunk in the output
+    // the chunks of the source and the feed keep their order, so a cold one waits for room in the I/O queue
+    auto admit = [&](std::optional<FileChunk> chunk, bool& slot) {
+        if (chunk && chunk->cold) {
+            io_slots.acquire();
+            slot = true;
+        }
+        return chunk;
+    };
+    // takes the next chunk, from the I/O queue if it has room or the CPU queue is empty, then from the source and
+    // then from the feed
+    auto take = [&](bool& slot) -> std::optional<FileChunk> {
+        std::size_t i;
+        if (next_cold < cold.size() && io_slots.try_acquire()) {
+            if ((i = next_cold++) < cold.size()) {
+                slot = true;
+                return chunks[cold[i]];
+            }
+            io_slots.release();
+        }
+        if ((i = next_cached++) < cached.size())
+            return chunks[cached[i]];
+        if (next_cold < cold.size()) {
+            io_slots.acquire();
+            if ((i = next_cold++) < cold.size()) {
+                slot = true;
+                return chunks[cold[i]];
+            }
+            io_slots.release();
+        }
+        if (source) {
+            std::unique_lock<std::mutex> lock(source_mutex);
+            while (sourced.empty()) {
+                auto next = source();
+                if (!next)
+                    break;
+                for (auto& chunk : next.value()) {
+                    chunk.sequence = next_sequence++;
+                    sourced.push(std::move(chunk));
+                }
+            }
+            if (!sourced.empty()) {
+                auto chunk = std::move(sourced.front());
+                sourced.pop();
+                lock.unlock();
+                return admit(std::move(chunk), slot);
+            }
+        }
+        return feed ? admit(feed->pop(), slot) : std::nullopt;
+    };
+    std::mutex mutex;                                         // guards the variables below
+    std::condition_variable finished;                         // notified when the last worker exits
+    std::vector<std::shared_ptr<Read>> reads(max_workers);    // the read in flight of every worker
+    std::vector<std::shared_ptr<Read>> hedges;                // duplicates waiting for a worker
+    int running = max_workers;                                // the workers that have not run out of chunks
+    std::vector<std::chrono::steady_clock::time_point> exits; // when the workers that searched anything ran out
+    std::vector<std::optional<FileChunk>> owned(max_workers); // the unread rest of the chunk of every worker
+    std::atomic<bool> cancelled = false;                      // set once the deadline passes
+    const int needle_size = static_cast<int>(searcher.needle.size());
+    // takes the next chunk, or when splitting lazily cuts the next read off the worker's chunk, stealing half of the
+    // largest rest of another worker's chunk once there are no chunks left
+    auto next_chunk = [&](int worker, bool& slot) -> std::optional<FileChunk> {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto& own = owned[worker];
+        if (!own || own->search.size() == 0) {
+            lock.unlock();
+            auto chunk = take(slot);
+            if (chunk && !lazy)
+                return chunk;
+            lock.lock();
+            if (chunk) {
+                own = std::move(chunk);
+            } else {
+                std::optional<FileChunk>* victim = nullptr;
+                for (auto& other : owned)
+                    if (other && steal_point(other->search, tuning.io_profile(other->file.filesystem).read_size) &&
+                        (!victim || other->search.size() > (*victim)->search.size()))
+                        victim = &other;
+                if (!victim)
+                    return std::nullopt;
+                const Range rest = (*victim)->search;
+                const long long middle =
+                    steal_point(rest, tuning.io_profile((*victim)->file.filesystem).read_size).value();
+                own = FileChunk((*victim)->file, Range{middle, rest.end}, needle_size);
+                own->cold = (*victim)->cold, own->sequence = (*victim)->sequence;
+                (*victim)->search.end = middle;
+                stats.steals++;
+                MINIGREP_PROBE4(steal, worker, victim - owned.data(), middle, rest.end - middle);
+            }
+        }
+        const long long size = tuning.io_profile(own->file.filesystem).read_size;
+        FileChunk result(own->file, Range{own->search.begin, std::min(own->search.end, own->search.begin + size)},
+                         needle_size);
+        result.cold = own->cold, result.sequence = own->sequence;
+        own->search.begin = result.search.end;
+        lock.unlock();
+        if (result.cold && !slot) { // every read of a cold chunk takes its place in the I/O queue, not just the first
+            io_slots.acquire();
+            slot = true;
+        }
+        return result;
+    };
+
+    auto work = [&](int worker) {
+        bool worked = false;
+        while (true) {
+            gate.enter(worker);
+            if (cancelled)
+                break;
+            std::shared_ptr<Read> read;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!hedges.empty())
+                    read = std::move(hedges.back()), hedges.pop_back();
+            }
+            if (read && read->claimed->load())
+                continue; // the original finished in the meantime
+            if (bool slot = false; !read) {
+                const auto chunk = next_chunk(worker, slot);
+                if (chunk && slot && cancelled)
+                    io_slots.release();
+                if (!chunk || cancelled)
+                    break;
+                read = std::make_shared<Read>(chunk.value(), std::make_shared<std::atomic<bool>>(false), false);
+                read->cold = slot;
+                stats.cold_chunks += slot;
+            }
+            const Filesystem filesystem = read->chunk.file.filesystem;
+            auto& queue = *queues[static_cast<int>(filesystem)];
+            queue.acquire();
+            read->started = std::chrono::steady_clock::now();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                reads[worker] = read;
+            }
+            MINIGREP_PROBE4(fetch_start, read->chunk.file.path.c_str(), read->chunk.read.begin, read->chunk.read.size(),
+                            worker);
+            // copied, as a worker the watchdog gave up on must not touch the schedule once its read returns
+            const bool measured = costs != nullptr;
+            const auto fetch_cpu = measured ? thread_cpu() : std::chrono::nanoseconds{};
+            read->chunk.fetch_contents(tuning.io_profile(filesystem).readahead);
+            if (measured) {
+                read->chunk.fetch_time = std::chrono::steady_clock::now() - read->started;
+                read->chunk.fetch_cpu = thread_cpu() - fetch_cpu;
+            }
+            MINIGREP_PROBE4(fetch_end, read->chunk.file.path.c_str(), read->chunk.read.begin,
+                            static_cast<long long>(read->chunk.contents.size()), worker);
+            if (auto state = Read::in_flight; !read->state.compare_exchange_strong(state, Read::done))
+                return; // the watchdog gave up on this worker and replaced it, nothing it refers to may be touched
+            queue.release();
+            if (read->cold)
+                io_slots.release();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                reads[worker].reset();
+            }
+            const auto latency = std::chrono::steady_clock::now() - read->started;
+            stats.latency[latency_bucket(std::chrono::duration_cast<std::chrono::microseconds>(latency).count())]++;
+            if (read->claimed->exchange(true))
+                continue; // the other copy of a hedged read won
+            stats.hedge_wins += read->hedge;
+            if (coverage)
+                coverage->add(read->chunk.file.path, read->chunk.search);
+            search(read->chunk, searcher, os, stats, sorter, output, results, costs);
+            worked = true;
+        }
+        gate.leave();
+        std::lock_guard<std::mutex> lock(mutex);
+        if (worked)
+            exits.push_back(std::chrono::steady_clock::now());
+        if (--running == 0)
+            finished.notify_all();
+    };
+    std::vector<std::jthread> threads;
+    for (int i = 0; i < max_workers; ++i)
+        threads.emplace_back(work, i);
+
+    std::jthread controller([&](std::stop_token stop) {
+        const bool climbing = tuning.workers < max_workers; // otherwise the number of workers is pinned
+        Pressure pressure;
+        if (!climbing && (pressure.files.empty() || tuning.pressure_threshold >= 100))
+            return;
+        Climb climb{gate.active, 1, 0};
+        int cap = max_workers;
+        auto last = std::chrono::steady_clock::now();
+        long long last_bytes = 0;
+        std::mutex mutex;
+        std::condition_variable_any cv;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!cv.wait_for(lock, stop, std::chrono::milliseconds(tuning.control_window), [] { return false; }) &&
+               !stop.stop_requested()) {
+            const auto now = std::chrono::steady_clock::now();
+            const double elapsed = std::chrono::duration<double>(now - last).count();
+            const long long bytes = stats.bytes;
+            const double throughput = (bytes - last_bytes) / elapsed;
+            const double stall = pressure.sample(elapsed);
+            const int next_cap = throttle(cap, stall, tuning.pressure_threshold, max_workers);
+            // while throttled the throughput says more about the pressure than about the number of workers
+            const Climb next = !climbing || cap < climb.workers ? Climb{climb.workers, climb.direction, throughput}
+                                                                : climb.step(throughput, max_workers);
+            if (trace && next_cap != cap)
+                *trace << "trace: " << stall * 100 << "% stalled, cap " << cap << " -> " << next_cap << "\n";
+            if (trace && next.workers != climb.workers)
+                *trace << "trace: " << throughput / 1e6 << " MB/s, workers " << climb.workers << " -> " << next.workers
+                       << (next.direction == climb.direction ? "\n" : " (turning)\n");
+            gate.resize(std::min(next.workers, next_cap));
+            climb = next, cap = next_cap, last = now, last_bytes = bytes;
+        }
+    });
+
+    const auto timeout = std::chrono::milliseconds(tuning.read_timeout);
+    const auto tick = std::clamp<std::chrono::milliseconds>(timeout / 4, std::chrono::milliseconds(1),
+                                                            std::chrono::milliseconds(100));
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!finished.wait_for(lock, tick, [&] { return running == 0; })) {
+        const auto now = std::chrono::steady_clock::now();
+        if (deadline && now >= deadline.value() && !cancelled.exchange(true)) {
+            stats.expired = true;
+            gate.release();
+            if (feed)
+                feed->close();
+        }
+        const auto slow = percentile(stats.latency, 0.99);
+        for (int worker = 0; worker < max_workers; ++worker) {
+            auto& read = reads[worker];
+            if (!read)
+                continue;
+            if (now - read->started > timeout) {
+                if (auto state = Read::in_flight; !read->state.compare_exchange_strong(state, Read::abandoned))
+                    continue;
+                if (!read->claimed->exchange(true)) {
+                    stats.timeouts++;
+                    if (output)
+                        output->write(read->request.sequence, {}); // the chunks after it need not wait for it
+                    std::cerr << "minigrep: " << read->chunk.file.path << " [" << read->chunk.search.begin << ", "
+                              << read->chunk.search.end << "): read timed out, skipped\n";
+                }
+                queues[static_cast<int>(read->chunk.file.filesystem)]->release();
+                if (read->cold)
+                    io_slots.release();
+                read.reset();
+                threads[worker].detach();
+                threads[worker] = std::jthread(work, worker);
+            } else if (hedge && slow && !read->hedge && !read->hedged &&
+                       now - read->started > std::chrono::microseconds(slow.value())) {
+                read->hedged = true;
+                hedges.push_back(std::make_shared<Read>(read->request, read->claimed, true));
+                stats.hedges++;
+            }
+        }
+    }
+    const auto end = std::chrono::steady_clock::now();
+    for (const auto& exit : exits)
+        stats.idle += std::chrono::duration_cast<std::chrono::microseconds>(end - exit).count();
+    lock.unlock();
+    for (auto& thread : threads)
+        if (thread.joinable())
+            thread.join();
+}
+
+/**
+ * Stream buffer that discards everything written to it.
+ */
+struct NullBuffer : std::streambuf {
+    int overflow(int c) override { return c; }
+};
+
+/**
+ * Measures how long a function takes to run.
+ * @param f The function to run.
+ * @return The elapsed time in seconds.
+ */
+template <typename F> [[nodiscard]] double seconds(F&& f) {
+    const auto start = std::chrono::steady_clock::now();
+    f();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * Drops the pages of a file from the page cache, so that the next read comes from storage.
+ * @param path Path of the file.
+ */
+void evict(const std::filesystem::path& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+    ::fdatasync(fd);
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    ::close(fd);
+}
+
+constexpr int calibration_size = 64 << 20; /**< The size of the scratch file used to calibrate storage. */
+constexpr int calibration_runs = 3;        /**< The number of runs whose best time is taken. */
+
+/**
+ * Runs microbenchmarks to find the tuning that suits this machine best.
+ * @param tuning The tuning to start from, its per filesystem overrides are kept.
+ * @param directory Directory in which a scratch file is created to measure the storage.
+ * @param log Stream to report progress to.
+ * @return The best tuning found, or std::nullopt if the scratch file could not be written.
+ */
+[[nodiscard]] std::optional<Tuning> calibrate(Tuning tuning, const std::filesystem::path& directory,
+                                             std::ostream& log) {
+    std::mt19937 random(0);
+    auto text = [&](int size, std::string_view alphabet) {
+        std::string result(size, ' ');
+        std::uniform_int_distribution<std::size_t> letter(0, alphabet.size() - 1);
+        for (auto& c : result)
+            c = alphabet[letter(random)];
+        return result;
+    };
+    const std::string contents = text(calibration_size, "abcdefghijklmnopqrstuvwxyz \n");
+    // only what is measured is tuned, the rest keeps following the defaults unless the profile overrides it
+    for (const auto key : {"engine_threshold", "chunk_size", "workers", "mmap_threshold", "direct_threshold"})
+        tuning.tuned.emplace(key);
+
+    // CPU: the shortest needle from which Boyer-Moore-Horspool stays faster than find
+    const std::string_view haystack = std::string_view(contents).substr(0, calibration_size / 4);
+    tuning.engine_threshold = std::numeric_limits<int>::max();
+    volatile std::size_t sink = 0; // keeps the searches from being optimized away
+    for (int length = 128; length >= 2; length /= 2) {
+        const std::string needle = text(length, "abcdefghijklmnopqrstuvwxyz");
+        auto best = [&](int threshold) {
+            const Searcher searcher(needle, threshold);
+            double result = std::numeric_limits<double>::max();
+            for (int run = 0; run < calibration_runs; ++run)
+                result = std::min(result, seconds([&] {
+                                      std::size_t count = 0;
+                                      for (auto pos = searcher.find(haystack, 0); pos != std::string::npos; ++count)
+                                          pos = searcher.find(haystack, pos + 1);
+                                      sink = count;
+                                  }));
+            return result;
+        };
+        const double find = best(std::numeric_limits<int>::max()), bmh = best(1);
+        log << "engine needle length " << length << ": find " << find << " s, boyer-moore-horspool " << bmh << " s\n";
+        if (bmh >= find)
+            break;
+        tuning.engine_threshold = length;
+    }
+
+    // Storage: chunk size and worker count, reading a scratch file with a cold page cache
+    const auto path = directory / ("minigrep-calibrate-" + std::to_string(::getpid()) + ".tmp");
+    if (!(std::ofstream(path, std::ios::binary) << contents)) {
+        std::filesystem::remove(path);
+        return std::nullopt;
+    }
+    const Searcher searcher("the", tuning.engine_threshold);
+    auto run = [&](int chunk_size, int workers, IoMethod io, bool cold) {
+        Tuning fixed = tuning;
+        fixed.chunk_size = chunk_size;
+        fixed.workers = fixed.max_workers = workers;
+        NullBuffer buffer;
+        std::ostream os(&buffer);
+        double result = std::numeric_limits<double>::max();
+        File file(path.string());
+        file.io = io;
+        for (int run = 0; run < calibration_runs; ++run) {
+            if (cold)
+                evict(path);
+            auto all_chunks = chunks(file, fixed.chunk_size, searcher.needle.size());
+            Stats stats;
+            result = std::min(result, seconds([&] { scan(all_chunks, searcher, fixed, os, stats); }));
+        }
+        return result;
+    };
+    double best = std::numeric_limits<double>::max();
+    for (int size = 64 << 10; size <= 16 << 20; size *= 4) {
+        const double elapsed = run(size, tuning.workers, IoMethod::pread, true);
+        log << "chunk_size " << size << ": " << elapsed << " s\n";
+        if (elapsed < best)
+            best = elapsed, tuning.chunk_size = size;
+    }
+    best = std::numeric_limits<double>::max();
+    for (int workers = 1; workers <= 2 * default_workers(); workers *= 2) {
+        const double elapsed = run(tuning.chunk_size, workers, IoMethod::pread, true);
+        log << "workers " << workers << ": " << elapsed << " s\n";
+        if (elapsed < 0.95 * best) // more threads have to pay for themselves
+            best = elapsed, tuning.workers = workers;
+    }
+
+    // I/O: whether mapping pays off for cached files, and bypassing the cache for uncached ones
+    const double pread_hot = run(tuning.chunk_size, tuning.workers, IoMethod::pread, false);
+    const double mmap_hot = run(tuning.chunk_size, tuning.workers, IoMethod::mmap, false);
+    log << "cached: pread " << pread_hot << " s, mmap " << mmap_hot << " s\n";
+    if (mmap_hot >= pread_hot)
+        tuning.mmap_threshold = std::numeric_limits<int>::max();
+    const double direct_cold = run(tuning.chunk_size, tuning.workers, IoMethod::direct, true);
+    log << "uncached: pread " << best << " s, direct " << direct_cold << " s\n";
+    if (direct_cold >= best)
+        tuning.direct_threshold = std::numeric_limits<int>::max();
+    std::filesystem::remove(path);
+    return tuning;
+}
+
+constexpr int serve_queries = 4; /**< The number of queries a daemon runs at once. */
+
+/**
+ * Publishes versions of a value to readers without blocking them, in the manner of read-copy-update. A reader pins
+ * the current version for as long as it needs it, a writer swaps in a new one at any time, and a retired version is
+ * freed once no reader can still be using it. Every reader announces the epoch in which it started in a slot of its
+ * own; a version retired in an epoch is freed once no slot holds that epoch or an earlier one.
+ */
+template <typename T> struct Rcu {
+    std::atomic<const T*> current;                           /**< The version new readers pin. */
+    std::atomic<std::uint64_t> epoch = 1;                    /**< The current epoch, advanced by every publication. */
+    std::vector<std::atomic<std::uint64_t>> slots;           /**< The epoch every reader started in, 0 while idle. */
+    std::mutex mutex;                                        /**< Serializes the writers and guards #retired. */
+    std::vector<std::pair<std::uint64_t, const T*>> retired; /**< The replaced versions and their epochs. */
+    std::atomic<long long> published = 1;                    /**< The number of versions published. */
+    std::atomic<long long> reclaimed = 0;                    /**< The number of versions freed. */
+
+    /**
+     * A reader's pin on the version that was current when it started.
+     */
+    struct Guard {
+        Rcu& rcu;                         /**< The publisher. */
+        std::atomic<std::uint64_t>& slot; /**< The reader's slot. */
+        const T* value;                   /**< The pinned version. */
+
+        /**
+         * Pins the current version.
+         * @param rcu The publisher.
+         * @param reader The reader's slot, which no other reader uses at the same time.
+         */
+        Guard(Rcu& rcu, int reader) : rcu(rcu), slot(rcu.slots[reader]) {
+            // announced before the version is loaded: a writer that does not see the announcement swapped the
+            // version before the load, which then pins the new one
+            slot = rcu.epoch.load();
+            value = rcu.current.load();
+        }
+
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+
+        /**
+         * Unpins the version, freeing the versions that were only kept for this reader.
+         */
+        ~Guard() {
+            slot = 0;
+            rcu.reclaim();
+        }
+
+        /**
+         * The pinned version.
+         * @return The pinned version.
+         */
+        const T& operator*() const { return *value; }
+
+        /**
+         * The pinned version.
+         * @return The pinned version.
+         */
+        const T* operator->() const { return value; }
+    };
+
+    /**
+     * Publishes the first version.
+     * @param initial The first version.
+     * @param readers The number of readers.
+     */
+    Rcu(std::unique_ptr<const T> initial, int readers) : current(initial.release()), slots(readers) {}
+
+    Rcu(const Rcu&) = delete;
+    Rcu& operator=(const Rcu&) = delete;
+
+    /**
+     * Frees every version, once no reader is left.
+     */
+    ~Rcu() {
+        delete current.load();
+        for (const auto& [epoch, version] : retired)
+            delete version;
+    }
+
+    /**
+     * Makes a version current. Readers that started before keep the one they pinned.
+     * @param next The new version.
+     */
+    void publish(std::unique_ptr<const T> next) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const T* previous = current.exchange(next.release());
+        retired.emplace_back(epoch.fetch_add(1), previous);
+        published++;
+        collect();
+    }
+
+    /**
+     * Frees the retired versions that no reader can be using anymore, unless a writer is busy doing so.
+     */
+    void reclaim() {
+        std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+        if (lock.owns_lock())
+            collect();
+    }
+
+  private:
+    /**
+     * Frees the retired versions older than the epoch of every active reader.
+     */
+    void collect() {
+        std::uint64_t oldest = std::numeric_limits<std::uint64_t>::max();
+        for (const auto& slot : slots)
+            if (const auto started = slot.load(); started != 0)
+                oldest = std::min(oldest, started);
+        std::erase_if(retired, [&](const auto& entry) {
+            if (entry.first >= oldest)
+                return false;
+            delete entry.second;
+            reclaimed++;
+            return true;
+        });
+    }
+};
+
+/**
+ * Everything the queries of a daemon read, replaced as a whole when the daemon reloads.
+ */
+struct Version {
+    long long number;           /**< The number of the version, counting from 1. */
+    Tuning tuning;              /**< The tuning loaded from the profile. */
+    std::optional<Index> index; /**< The index loaded from the index file, if any. */
+};
+
+constexpr int serve_cache = 64; /**< The number of queries whose results a daemon keeps. */
+
+/**
+ * The results of the recent queries of a daemon per file, so that repeating a query only searches the files that
+ * changed since. The matches of a file are used again while its modification time, size and inode are those it had
+ * when it was searched. The least recently used queries are evicted first.
+ */
+struct QueryCache {
+    /**
+     * The matches of one file.
+     */
+    struct FileResult {
+        long long mtime;                         /**< The modification time of the file when it was searched. */
+        long long size;                          /**< The size of the file when it was searched. */
+        unsigned long long inode;                /**< The inode of the file when it was searched. */
+        std::shared_ptr<const std::string> text; /**< The matches as printed, nullptr if there are none. */
+        long long matches = 0;                   /**< The number of matches. */
+    };
+
+    using Files = std::map<std::string, FileResult>; /**< The results of a query per path. */
+
+    std::size_t capacity; /**< The number of queries kept. */
+    std::mutex mutex;     /**< Guards the members below. */
+    std::map<std::string, std::pair<long long, std::shared_ptr<const Files>>> entries; /**< Last use and results. */
+    long long uses = 0;      /**< The number of lookups, which orders the entries by their last use. */
+    long long hits = 0;      /**< The queries answered without searching. */
+    long long partial = 0;   /**< The queries that searched some of the files again. */
+    long long misses = 0;    /**< The queries that were not cached. */
+    long long reused = 0;    /**< The files whose cached matches were used. */
+    long long rescanned = 0; /**< The files searched again as they were not cached or changed. */
+
+    /**
+     * Creates an empty cache.
+     * @param capacity The number of queries to keep.
+     */
+    explicit QueryCache(std::size_t capacity) : capacity(capacity) {}
+
+    /**
+     * Looks up the results of a query.
+     * @param key The query.
+     * @return The results, or nullptr if they are not cached.
+     */
+    [[nodiscard]] std::shared_ptr<const Files> find(const std::string& key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto it = entries.find(key);
+        if (it == entries.end())
+            return nullptr;
+        it->second.first = ++uses;
+        return it->second.second;
+    }
+
+    /**
+     * Stores the results of a query, evicting the least recently used one if the cache is full.
+     * @param key The query.
+     * @param files The results.
+     * @param found Whether results were cached before.
+     * @param searched The number of files searched again.
+     */
+    void store(const std::string& key, std::shared_ptr<const Files> files, bool found, long long searched) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!found)
+            misses++;
+        else if (searched > 0)
+            partial++;
+        else
+            hits++;
+        rescanned += searched;
+        reused += static_cast<long long>(files->size()) - searched;
+        entries[key] = {++uses, std::move(files)};
+        while (entries.size() > capacity)
+            entries.erase(std::min_element(entries.begin(), entries.end(), [](const auto& l, const auto& r) {
+                return l.second.first < r.second.first;
+            }));
+    }
+};
+
+/**
+ * Runs a query of a daemon, searching only the files whose cached matches are missing or out of date.
+ * @param version The version to run it against.
+ * @param root Path to the directory or file to be searched.
+ * @param needle The string to search for.
+ * @param cache The results of recent queries.
+ * @param stats Counters to update, whose matches include the cached ones.
+ * @return The matches, printed the way a search prints them, file by file in the order of the traversal.
+ */
+[[nodiscard]] std::string query(const Version& version, const std::filesystem::path& root, std::string_view needle,
+                                QueryCache& cache, Stats& stats) {
+    const auto& tuning = version.tuning;
+    std::error_code error;
+    std::optional<std::vector<File>> files;
+    if (version.index && std::filesystem::canonical(root, error) == version.index->root)
+        files = planned_files(version.index.value(), plan(version.index.value(), needle, tuning.index_threshold, {}),
+                              root);
+    else
+        files = minigrep::files(root.string());
+    if (!files)
+        return {};
+    const auto key = root.string() + '\0' + std::string(needle);
+    const auto cached = cache.find(key);
+    auto results = std::make_shared<QueryCache::Files>();
+    std::vector<FileChunk> all_chunks;
+    long long searched = 0;
+    for (auto& file : files.value()) {
+        const auto* previous = cached && cached->contains(file.path) ? &cached->at(file.path) : nullptr;
+        if (previous && previous->mtime == file.mtime && previous->size == file.size && previous->inode == file.inode) {
+            results->emplace(file.path, *previous);
+            continue;
+        }
+        results->emplace(file.path, QueryCache::FileResult{file.mtime, file.size, file.inode, nullptr});
+        searched++;
+        file.choose_io(tuning);
+        const auto chunks = minigrep::chunks(file, tuning.io_profile(file.filesystem).read_size, needle.size());
+        all_chunks.insert(all_chunks.end(), chunks.begin(), chunks.end());
+    }
+    Results found;
+    Schedule schedule;
+    schedule.results = &found;
+    std::ostringstream unused;
+    scan(all_chunks, Searcher(std::string(needle), tuning.engine_threshold), tuning, unused, stats, schedule);
+    for (auto& [path, matches] : found.files) {
+        std::sort(matches.begin(), matches.end());
+        std::ostringstream text;
+        for (const auto& match : matches)
+            text << match << "\n";
+        auto& result = results->at(path);
+        result.text = std::make_shared<const std::string>(std::move(text).str());
+        result.matches = static_cast<long long>(matches.size());
+    }
+    std::string output;
+    long long total = 0;
+    for (const auto& file : files.value()) {
+        const auto& result = results->at(file.path);
+        output += result.text ? *result.text : "";
+        total += result.matches;
+    }
+    stats.matches = total;
+    if (stats.timeouts == 0) // the files whose reads were skipped would be cached without their matches
+        cache.store(key, std::move(results), cached != nullptr, searched);
+    return output;
+}
+
+/**
+ * Serves queries read from a stream, one command per line, until it ends:
+ * `search STRING` searches the root for STRING, `reload` loads the profile and the index again and publishes them
+ * as a new version, and `stats` prints the counters of the daemon. Up to serve_queries searches run at once, each on
+ * the version that was current when it started, so a reload never waits for them nor they for it, and repeated
+ * searches only search the files that changed since their results were cached. The result of a
+ * search is a line `query ID: N matches (version V)` followed by the N matches.
+ * @param is The stream to read commands from.
+ * @param os The stream to print results to.
+ * @param root Path to the directory or file to be searched.
+ * @param load Loads a version with the given number, or returns nullptr if it cannot.
+ * @return Whether the first version could be loaded.
+ */
+bool serve(std::istream& is, std::ostream& os, const std::filesystem::path& root,
+           const std::function<std::unique_ptr<const Version>(long long)>& load) {
+    auto first = load(1);
+    if (!first)
+        return false;
+    Rcu<Version> versions(std::move(first), serve_queries);
+    QueryCache cache(serve_cache);
+    std::mutex mutex;                                     // guards the variables below and the output
+    std::condition_variable ready;                        // notified when a query is queued or the input ends
+    std::queue<std::pair<long long, std::string>> queued; // the queries waiting for a reader, with their ids
+    bool ended = false;                                   // whether the input ended
+    long long served = 0, matches = 0;                    // the counters of the finished queries
+    auto reader = [&](int slot) {
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex);
+            ready.wait(lock, [&] { return ended || !queued.empty(); });
+            if (queued.empty())
+                return;
+            const auto [id, needle] = std::move(queued.front());
+            queued.pop();
+            lock.unlock();
+            Stats stats;
+            const Rcu<Version>::Guard version(versions, slot);
+            const auto result = query(*version, root, needle, cache, stats);
+            lock.lock();
+            os << "query " << id << ": " << stats.matches << " matches (version " << version->number << ")\n"
+               << result << std::flush;
+            served++;
+            matches += stats.matches;
+        }
+    };
+    std::vector<std::jthread> readers;
+    for (int slot = 0; slot < serve_queries; ++slot)
+        readers.emplace_back(reader, slot);
+    long long next_id = 1;
+    for (std::string line; std::getline(is, line);) {
+        if (line.starts_with("search ") && line.size() > 7) {
+            std::lock_guard<std::mutex> lock(mutex);
+            queued.emplace(next_id++, line.substr(7));
+            ready.notify_one();
+        } else if (line == "reload") {
+            auto next = load(versions.published + 1);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (next) {
+                const long long number = next->number;
+                versions.publish(std::move(next));
+                os << "reloaded: version " << number << "\n" << std::flush;
+            } else {
+                os << "reload failed\n" << std::flush;
+            }
+        } else if (line == "stats") {
+            versions.reclaim();
+            std::lock_guard<std::mutex> lock(mutex);
+            os << "stats: " << served << " queries, " << matches << " matches, " << versions.published
+               << " versions published, " << versions.reclaimed << " reclaimed\n";
+            std::lock_guard<std::mutex> cache_lock(cache.mutex);
+            const long long lookups = cache.hits + cache.partial + cache.misses;
+            os << "cache: " << cache.hits << " hits, " << cache.partial << " partial, " << cache.misses << " misses, "
+               << (lookups ? 100.0 * cache.hits / lookups : 0) << "% hit rate, " << cache.reused << " files reused, "
+               << cache.rescanned << " searched\n"
+               << std::flush;
+        } else if (!line.empty()) {
+            std::lock_guard<std::mutex> lock(mutex);
+            os << "unknown command: " << line << "\n" << std::flush;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ended = true;
+    }
+    ready.notify_all();
+    return true;
+}
+
+/**
+ * The peak resident set size of the process so far.
+ * @return The size in bytes.
+ */
+[[nodiscard]] long long peak_rss() {
+    struct rusage usage{};
+    ::getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss * 1024LL;
+}
+
+/**
+ * Prints the tuning that was applied and the counters of a scan.
+ * @param os The stream to print to.
+ * @param tuning The tuning that was applied.
+ * @param profile Path of the profile the tuning was loaded from.
+ * @param searcher The searcher that was used.
+ * @param stats The counters of the scan.
+ * @param elapsed The duration of the scan in seconds.
+ */
+void print_stats(std::ostream& os, const Tuning& tuning, const std::filesystem::path& profile,
+                 const Searcher& searcher, const Stats& stats, double elapsed) {
+    os << "profile: " << profile.string() << (tuning.tuned.empty() ? " (not loaded)" : "") << "\n";
+    for (const auto& [key, value] : tuning_keys)
+        os << key << ": " << tuning.*value << (tuning.tuned.contains(key) ? " (tuned)" : " (default)") << "\n";
+    for (std::size_t i = 0; i < filesystem_names.size(); ++i) {
+        if (!stats.filesystem_chunks[i])
+            continue;
+        const auto profile = tuning.io_profile(static_cast<Filesystem>(i));
+        os << "filesystem " << filesystem_names[i] << ": " << stats.filesystem_chunks[i] << " chunks";
+        for (const auto& [key, value] : io_profile_keys) {
+            const auto name = std::string(filesystem_names[i]) + "." + std::string(key);
+            os << ", " << key << " " << profile.*value << (tuning.tuned.contains(name) ? " (tuned)" : "");
+        }
+        os << "\n";
+    }
+    os << "engine: " << searcher.engine() << "\n";
+    if (!searcher.automata.empty()) {
+        std::size_t states = 0, bytes = 0;
+        for (const auto& automaton : searcher.automata)
+            states += automaton.lengths.size(), bytes += automaton.bytes();
+        os << "automaton: " << searcher.automata.size() << " shards, " << states << " states, " << bytes / 1e6
+           << " MB, " << std::clamp(searcher.streams, 1, Automaton::max_streams) << " streams\n";
+    }
+    for (std::size_t i = 0; i < io_names.size(); ++i)
+        if (stats.io_chunks[i])
+            os << "io " << io_names[i] << ": " << stats.io_chunks[i] << " chunks, " << stats.io_bytes[i] << " bytes\n";
+    os << "chunks: " << stats.chunks << "\n";
+    os << "bytes: " << stats.bytes << "\n";
+    os << "matches: " << stats.matches << "\n";
+    os << "timeouts: " << stats.timeouts << "\n";
+    os << "hedges: " << stats.hedges << " (" << stats.hedge_wins << " won)\n";
+    os << "cold chunks: " << stats.cold_chunks << "\n";
+    os << "steals: " << stats.steals << "\n";
+    os << "idle: " << stats.idle / 1e6 << " s\n";
+    os << "peak rss: " << peak_rss() / 1e6 << " MB\n";
+    os << "elapsed: " << elapsed << " s\n";
+}
+
+/**
+ * The things minigrep can do.
+ */
+enum class Command { search, calibrate, index, serve };
+
+/**
+ * Parsed command line.
+ */
+struct Options {
+    Command command = Command::search;             /**< What to do. */
+    bool stats = false;                            /**< Whether to print statistics to stderr. */
+    bool trace = false;                            /**< Whether to log scheduling decisions to stderr. */
+    bool explain = false;                          /**< Whether to print the plan instead of searching. */
+    bool hedge = false;                            /**< Whether to issue slow reads again. */
+    bool sorted = false;                           /**< Whether to print the matches ordered by path and position. */
+    std::optional<int> read_timeout;               /**< The time in milliseconds to abandon a read after, if given. */
+    std::optional<int> pressure;                   /**< The stall percentage to back off from, if given. */
+    std::optional<IoMethod> io;                    /**< The I/O method forced on every file, if given. */
+    std::optional<Strategy> strategy;              /**< The strategy forced on every directory, if given. */
+    Order order = Order::directory;                /**< The order in which files are searched. */
+    bool lazy = false;                             /**< Whether files are split when workers steal, not up front. */
+    std::optional<std::filesystem::path> list;     /**< The files to search first with --order=list:FILE. */
+    std::optional<int> time_budget;                /**< The time in milliseconds after which to stop, if given. */
+    std::optional<int> profile_files;              /**< The number of most costly files to report, if given. */
+    std::optional<std::filesystem::path> coverage; /**< The coverage report to write. */
+    std::optional<std::filesystem::path> resume;   /**< The coverage report of the ranges to skip. */
+    std::optional<std::filesystem::path> output;   /**< The file to write the matches to instead of stdout. */
+    std::optional<std::filesystem::path> state;    /**< The state file of the marks of append-only files. */
+    std::optional<std::filesystem::path> snapshot; /**< The snapshot of the file list to traverse through. */
+    std::optional<std::filesystem::path> profile;  /**< The profile given on the command line. */
+    std::optional<std::filesystem::path> index;    /**< The index to build or to plan with. */
+    std::optional<std::filesystem::path> patterns; /**< The patterns to search for instead of a search string. */
+    std::vector<std::string> arguments;            /**< The positional arguments. */
+};
+
+constexpr std::string_view usage = "Usage: minigrep [options] <directory|file> <search string>\n"
+                                   "       minigrep [options] --patterns=FILE <directory|file>\n"
+                                   "       minigrep [options] calibrate [directory]\n"
+                                   "       minigrep --index=FILE index <directory>\n"
+                                   "       minigrep [options] serve <directory|file>\n"
+                                   "Options:\n"
+                                   "  --profile=FILE      Tuning profile to load or write\n"
+                                   "  --index=FILE        Trigram index to build or to plan the search with\n"
+                                   "  --plan=PLAN         Use the index (index) or not (scan) in every directory\n"
+                                   "  --explain           Print the plan instead of searching\n"
+                                   "  --patterns=FILE     Search for every line of FILE, not with --index or --state\n"
+                                   "  --io=METHOD         Read every file using stream, pread, mmap or direct\n"
+                                   "  --order=ORDER       Search files in directory, physical, size-desc, size-asc,\n"
+                                   "                      mtime-desc or list:FILE order\n"
+                                   "  --split=SPLIT       Split files up front (static) or when workers steal (lazy)\n"
+                                   "  --time-budget=TIME  Stop after TIME (5s, 500ms, 2m), newest files first\n"
+                                   "  --coverage=FILE     Write the files and byte ranges searched to FILE\n"
+                                   "  --resume=FILE       Skip the ranges in the coverage report FILE\n"
+                                   "  --state=FILE        Search only what was appended since the run that wrote FILE\n"
+                                   "  --snapshot=FILE     List only directories changed since the run that wrote FILE\n"
+                                   "  --pressure=PCT      Back off while some task stalls PCT% of the time\n"
+                                   "  --read-timeout=MS   Skip chunks whose read takes longer than MS\n"
+                                   "  --hedge             Issue reads slower than the 99th percentile again\n"
+                                   "  --sorted            Print the matches ordered by path and position\n"
+                                   "  --output=FILE       Write the matches to FILE from all workers at once\n"
+                                   "  --stats             Print tuning and statistics to stderr\n"
+                                   "  --profile-files=N   Print the N most costly files by every measure to stderr\n"
+                                   "  --trace             Log scheduling decisions to stderr\n";
+
+/**
+ * Parses the command line.
+ * @param argc The number of arguments.
+ * @param argv The arguments.
+ * @return The options, or std::nullopt if the command line is not valid.
+ */
+[[nodiscard]] std::optional<Options> parse_options(int argc, char** argv) {
+    Options result;
+    bool ordered = false;
+    for (int i = 1; i < argc; ++i) {
+        const std::string_view arg = argv[i];
+        std::string_view value;
+        auto option = [&](std::string_view name) { // matches both --name=value and --name value
+            if (arg.starts_with(name) && arg.size() > name.size() && arg[name.size()] == '=')
+                return value = arg.substr(name.size() + 1), true;
+            if (arg == name && i + 1 < argc)
+                return value = argv[++i], true;
+            return false;
+        };
+        if (arg == "--stats")
+            result.stats = true;
+        else if (arg == "--trace")
+            result.trace = true;
+        else if (arg == "--explain")
+            result.explain = true;
+        else if (arg == "--hedge")
+            result.hedge = true;
+        else if (arg == "--sorted")
+            result.sorted = true;
+        else if (option("--io")) {
+            if (!(result.io = parse_io(value)) && value != "auto")
+                return std::nullopt;
+        } else if (option("--plan")) {
+            const auto it = std::find(strategy_names.begin(), strategy_names.end(), value);
+            if (it != strategy_names.end())
+                result.strategy = static_cast<Strategy>(it - strategy_names.begin());
+            else if (value != "auto")
+                return std::nullopt;
+        } else if (option("--order")) {
+            const auto it = std::find(order_names.begin(), order_names.end(), value);
+            if (value.starts_with("list:") && value.size() > 5)
+                result.order = Order::list, result.list = value.substr(5);
+            else if (it != order_names.end() && *it != "list")
+                result.order = static_cast<Order>(it - order_names.begin());
+            else
+                return std::nullopt;
+            ordered = true;
+        } else if (option("--time-budget")) {
+            if (!(result.time_budget = parse_duration(value)))
+                return std::nullopt;
+        } else if (option("--coverage")) {
+            result.coverage = value;
+        } else if (option("--resume")) {
+            result.resume = value;
+        } else if (option("--output")) {
+            result.output = value;
+        } else if (option("--state")) {
+            result.state = value;
+        } else if (option("--snapshot")) {
+            result.snapshot = value;
+        } else if (option("--split")) {
+            if (value != "static" && value != "lazy")
+                return std::nullopt;
+            result.lazy = value == "lazy";
+        } else if (option("--pressure")) {
+            if (!(result.pressure = parse_positive(value)))
+                return std::nullopt;
+        } else if (option("--profile-files")) {
+            if (!(result.profile_files = parse_positive(value)))
+                return std::nullopt;
+        } else if (option("--read-timeout")) {
+            if (!(result.read_timeout = parse_positive(value)))
+                return std::nullopt;
+        } else if (option("--profile"))
+            result.profile = value;
+        else if (option("--index"))
+            result.index = value;
+        else if (option("--patterns"))
+            result.patterns = value;
+        else if (arg.starts_with("--"))
+            return std::nullopt;
+        else
+            result.arguments.emplace_back(arg);
+    }
+    if (result.time_budget && !ordered) // the hits that matter most should come before the budget runs out
+        result.order = Order::mtime_desc;
+    if (!result.arguments.empty() && result.arguments.front() == "calibrate") {
+        result.command = Command::calibrate;
+        result.arguments.erase(result.arguments.begin());
+        return result.arguments.size() <= 1 ? std::optional(result) : std::nullopt;
+    }
+    if (!result.arguments.empty() && result.arguments.front() == "index") {
+        result.command = Command::index;
+        result.arguments.erase(result.arguments.begin());
+        return result.arguments.size() == 1 && result.index ? std::optional(result) : std::nullopt;
+    }
+    if (!result.arguments.empty() && result.arguments.front() == "serve") {
+        result.command = Command::serve;
+        result.arguments.erase(result.arguments.begin());
+        return result.arguments.size() == 1 ? std::optional(result) : std::nullopt;
+    }
+    if (result.patterns) // neither the index nor the marks know of more than one string
+        return result.arguments.size() == 1 && !result.index && !result.state ? std::optional(result) : std::nullopt;
+    return result.arguments.size() == 2 ? std::optional(result) : std::nullopt;
+}
+
+namespace test {
+
+static_assert(Range{1, 3}.clamp(0, 2) == Range{1, 2});
+static_assert(Range{1, 3}.extend(2) == Range{-1, 5});
+static_assert(Range{1, 3}.size() == 2);
+static_assert(Range{0, chunk_size + 100}.split(chunk_size).value() ==
+              std::make_pair(Range{0, chunk_size}, Range{chunk_size, chunk_size + 100}));
+static_assert(!Range{0, 100}.split(100));
+static_assert(prefix("abcd", 0) == "");
+static_assert(prefix("abcd", 2) == "ab");
+static_assert(suffix("abcd", 0) == "abc");
+static_assert(suffix("abcd", 2) == "cd");
+// static_assert(transform("abcd") == "abcd");
+// static_assert(transform("\t\n") == "\\t\\n");
+static_assert(Climb{4, 1, 100}.step(100, 8) == Climb{5, 1, 100});
+static_assert(Climb{4, 1, 100}.step(50, 8) == Climb{3, -1, 50});
+static_assert(Climb{16, -1, 100}.step(200, 32) == Climb{14, -1, 200});
+static_assert(Climb{8, 1, 100}.step(100, 8) == Climb{8, -1, 100});
+static_assert(Climb{1, -1, 100}.step(100, 8) == Climb{1, 1, 100});
+static_assert(stall_total("some avg10=0.00 avg60=0.05 avg300=0.29 total=4235207") == 4235207);
+static_assert(!stall_total("full avg10=0.00 avg60=0.03 avg300=0.25 total=3849954"));
+static_assert(throttle(8, 0.2, 10, 8) == 4);
+static_assert(throttle(1, 0.2, 10, 8) == 1);
+static_assert(throttle(4, 0.07, 10, 8) == 4);
+static_assert(throttle(4, 0.01, 10, 8) == 5);
+static_assert(throttle(8, 0, 10, 8) == 8);
+static_assert(filesystem(0x6969) == Filesystem::nfs);
+static_assert(filesystem(0x1234) == Filesystem::other);
+static_assert(parse_io("mmap") == IoMethod::mmap);
+static_assert(!parse_io("auto"));
+static_assert(resident_fraction({true, false, true, true}) == 0.75 && resident_fraction({}) == 0);
+static_assert(choose_io(IoFacts{4096, Filesystem::ext4, false, 1}, mmap_threshold, direct_threshold) ==
+              IoMethod::pread);
+static_assert(choose_io(IoFacts{8 << 20, Filesystem::ext4, false, 1}, mmap_threshold, direct_threshold) ==
+              IoMethod::mmap);
+static_assert(choose_io(IoFacts{1 << 30, Filesystem::xfs, false, 0}, mmap_threshold, direct_threshold) ==
+              IoMethod::direct);
+static_assert(choose_io(IoFacts{1 << 30, Filesystem::xfs, true, 0}, mmap_threshold, direct_threshold) ==
+              IoMethod::pread);
+static_assert(choose_io(IoFacts{1 << 30, Filesystem::nfs, false, 1}, mmap_threshold, direct_threshold) ==
+              IoMethod::pread);
+static_assert(pages(Range{0, 1}) == Range{0, 1});
+static_assert(pages(Range{page_size - 1, 2 * page_size}) == Range{0, 2});
+static_assert(pages(Range{page_size, page_size}).size() == 0);
+static_assert(trigram_bucket(255, 255, 255) < index_bits);
+static_assert(trigram_buckets("ab").empty());
+static_assert(trigram_buckets("abcabc").size() == 3);
+static_assert(choose_strategy(0.01, 5, index_threshold) == Strategy::index);
+static_assert(choose_strategy(0.9, 5, index_threshold) == Strategy::scan);
+static_assert(choose_strategy(0, 2, index_threshold) == Strategy::scan);
+static_assert(steal_point(Range{0, 100 * page_size}, page_size) == 50 * page_size);
+static_assert(steal_point(Range{1, 3 * page_size}, page_size) == page_size);
+static_assert(!steal_point(Range{0, 4 * page_size}, 4 * page_size));
+static_assert(!steal_point(Range{1, page_size + 2}, 0));
+static_assert(latency_bucket(0) == 0);
+static_assert(latency_bucket(1) == 1);
+static_assert(latency_bucket(1000) == 10);
+static_assert(!percentile(std::array<int, 4>{0, 10, 0, 0}, 0.99));
+static_assert(percentile(std::array<int, 4>{0, 98, 1, 1}, 0.99) == 4);
+static_assert(percentile(std::array<int, 4>{0, 100, 0, 0}, 0.99) == 2);
+static_assert(fed(Order::mtime_desc) && fed(Order::list) && !fed(Order::physical));
+static_assert(merge({{5, 8}, {0, 5}, {10, 12}, {11, 11}}) == std::vector<Range>{{0, 8}, {10, 12}});
+static_assert(uncovered({0, 10}, {{2, 4}, {6, 12}}) == std::vector<Range>{{0, 2}, {4, 6}});
+static_assert(uncovered({0, 10}, {}) == std::vector<Range>{{0, 10}});
+static_assert(uncovered({0, 10}, {{0, 10}}).empty());
+static_assert(fingerprint("") == 14695981039346656037ull);
+static_assert(fingerprint("a") == 0xaf63dc4c8601ec8cull);
+static_assert(delta(Mark{7, 100, 3, 9}, 7, 150, 9) == Range{97, 150});
+static_assert(delta(Mark{7, 100, 3, 9}, 7, 100, 9) == Range{97, 100});
+static_assert(delta(Mark{7, 100, 3, 9}, 7, 50, std::nullopt) == Range{0, 50});
+static_assert(delta(Mark{7, 100, 3, 9}, 8, 150, 9) == Range{0, 150});
+static_assert(delta(Mark{7, 100, 3, 9}, 7, 150, 5) == Range{0, 150});
+static_assert(delta(Mark{7, 2, 3, 9}, 7, 10, 9) == Range{0, 10});
+static_assert(parse_duration("5s") == 5000);
+static_assert(parse_duration("250ms") == 250);
+static_assert(parse_duration("2m") == 120'000);
+static_assert(parse_duration("3") == 3000);
+static_assert(!parse_duration("0s"));
+static_assert(!parse_duration("5h"));
+static_assert(parse_natural("0") == 0);
+static_assert(parse_positive("42") == 42);
+static_assert(!parse_positive("0"));
+static_assert(!parse_positive("4x"));
+static_assert(parse_positive("2147483647") == std::numeric_limits<int>::max());
+static_assert(!parse_positive("2147483648"));
+/**
+ * Makes strings in a constant expression, where GCC rejects initializer lists of them.
+ * @param texts The characters of the strings.
+ * @return The strings.
+ */
+constexpr std::vector<std::string> strings(const auto&... texts) { return {std::string(texts)...}; }
+
+static_assert(common_prefix("abc", "abd") == 2);
+static_assert(common_prefix("ab", "abc") == 2);
+static_assert(automaton_bytes(strings("ab", "ac")) == Automaton::bytes(4, 4));
+static_assert(shard_patterns(strings("b", "a", "a"), 0).size() == 1);
+static_assert(shard_patterns(strings("cd", "ab"), Automaton::bytes(3, 3)).front().front() == "ab");
+static_assert(shard_patterns(strings("cd", "ab"), Automaton::bytes(3, 3)).size() == 2);
+static_assert(shard_patterns(strings("ab", "abc"), Automaton::bytes(4, 4)).size() == 1);
+static_assert(shard_patterns(strings("abcdef"), 1).size() == 1);
+static_assert(pass_cost(16, 1) == 16 && pass_cost(16, 8) == 2 && pass_cost(4, 8) == 1);
+static_assert(plan_shards(strings("ab", "cd"), 1, {0, 0, 2 * Automaton::bytes(3, 3), 0}, 4, 16).size() == 2);
+static_assert(plan_shards(strings("ab", "cd"), 8, {0, 0, 2 * Automaton::bytes(3, 3), 0}, 4, 16).size() == 1);
+static_assert(plan_shards(strings("ab", "cd"), 1, {0, 0, 2 * Automaton::bytes(3, 3), 1 << 20}, 4, 16).size() == 2);
+static_assert(plan_shards(strings("ab", "cd"), 4, {0, 0, 2 * Automaton::bytes(3, 3), 1 << 20}, 4, 16).size() == 1);
+static_assert(plan_shards(strings("ab", "cd"), 1, cache_sizes, 4, 16).size() == 1);
+static_assert((Automaton::max_memory / Automaton::bytes(1, 256) - 1) * 256 < Automaton::match);
+static_assert(Automaton(strings("abcd", "bc")).find_all("xabcdx", 0, 6, 1) ==
+              std::vector<std::pair<std::size_t, std::size_t>>{{1, 4}, {2, 2}});
+static_assert(Automaton(strings("abcd", "bc", "c")).find_all("xabcdx", 0, 6, 2) ==
+              std::vector<std::pair<std::size_t, std::size_t>>{{1, 4}, {2, 2}, {3, 1}});
+
+} // namespace test
+
+} // namespace minigrep
+
+#ifndef MINIGREP_NO_MAIN // defined by the benchmarks that drive the library directly
+
+int main(int argc, char** argv) {
+    const auto start = std::chrono::steady_clock::now();
+    const auto options = minigrep::parse_options(argc, argv);
+    if (!options) {
+        std::cerr << minigrep::usage;
+        return EXIT_FAILURE;
+    }
+    const auto profile = options->profile.value_or(minigrep::default_profile_path());
+
+    if (options->command == minigrep::Command::calibrate) {
+        const auto directory = options->arguments.empty() ? std::filesystem::temp_directory_path()
+                                                           : std::filesystem::path(options->arguments.front());
+        const auto tuning = minigrep::calibrate(minigrep::load_tuning(profile), directory, std::cerr);
+        if (!tuning) {
+            std::cerr << "Could not write a scratch file to " << directory << "\n";
+            return EXIT_FAILURE;
+        }
+        if (!minigrep::save_tuning(profile, tuning.value())) {
+            std::cerr << "Could not write profile " << profile << "\n";
+            return EXIT_FAILURE;
+        }
+        std::cerr << "Wrote profile " << profile << "\n";
+        return EXIT_SUCCESS;
+    }
+
+    auto tuning = minigrep::load_tuning(profile);
+    tuning.pressure_threshold = options->pressure.value_or(tuning.pressure_threshold);
+    tuning.read_timeout = options->read_timeout.value_or(tuning.read_timeout);
+
+    if (options->command == minigrep::Command::index) {
+        const auto index = minigrep::build_index(options->arguments[0], tuning.workers);
+        if (!index) {
+            std::cerr << "Argument 1 must be a directory\n";
+            return EXIT_FAILURE;
+        }
+        if (!minigrep::save_index(options->index.value(), index.value())) {
+            std::cerr << "Could not write index " << options->index.value() << "\n";
+            return EXIT_FAILURE;
+        }
+        std::cerr << "Indexed " << index->entries.size() << " files\n";
+        return EXIT_SUCCESS;
+    }
+
+    std::optional<minigrep::Snapshot> snapshot;
+    if (options->snapshot)
+        snapshot = minigrep::load_snapshot(options->snapshot.value()); // without one every directory is listed
+    minigrep::Listing listing;
+    listing.taken = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::system_clock::now().time_since_epoch())
+                        .count();
+    // hands every file to be searched to a function, through the snapshot if there is one
+    auto walk = [&](const std::function<bool(minigrep::File)>& visit) {
+        if (!options->snapshot || !std::filesystem::is_directory(options->arguments[0]))
+            return minigrep::visit_files(options->arguments[0], visit);
+        listing.complete =
+            minigrep::visit_snapshot(options->arguments[0], snapshot ? &snapshot.value() : nullptr, listing, visit);
+        return true;
+    };
+
+    if (options->command == minigrep::Command::serve) {
+        // every reload reads the profile and the index again
+        auto load = [&](long long number) -> std::unique_ptr<const minigrep::Version> {
+            auto tuning = minigrep::load_tuning(profile);
+            tuning.pressure_threshold = options->pressure.value_or(tuning.pressure_threshold);
+            tuning.read_timeout = options->read_timeout.value_or(tuning.read_timeout);
+            std::optional<minigrep::Index> index;
+            if (options->index && !(index = minigrep::load_index(options->index.value())))
+                return nullptr;
+            return std::make_unique<const minigrep::Version>(minigrep::Version{number, tuning, std::move(index)});
+        };
+        if (!minigrep::serve(std::cin, std::cout, options->arguments[0], load)) {
+            std::cerr << "Could not read index " << options->index.value() << "\n";
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    std::optional<std::vector<minigrep::File>> files;
+    minigrep::FileTable table(tuning.table_memory);
+    if (options->index) {
+        const auto index = minigrep::load_index(options->index.value());
+        std::error_code error;
+        if (!index || std::filesystem::canonical(options->arguments[0], error) != index->root) {
+            std::cerr << "Index " << options->index.value() << " does not cover " << options->arguments[0] << "\n";
+            return EXIT_FAILURE;
+        }
+        const auto plans =
+            minigrep::plan(index.value(), options->arguments[1], tuning.index_threshold, options->strategy);
+        if (options->explain) {
+            minigrep::explain(std::cout, plans);
+            return EXIT_SUCCESS;
+        }
+        files = minigrep::planned_files(index.value(), plans, options->arguments[0]);
+    } else if (options->explain) {
+        std::cout << "scan, no index\n";
+        return EXIT_SUCCESS;
+    } else if (!minigrep::fed(options->order)) {
+        files.emplace(); // the traversed files stay in the table
+        if (!walk([&](minigrep::File file) {
+                table.add(file);
+                return true;
+            })) {
+            files.reset();
+        } else if (table.failed) {
+            std::cerr << "Could not spill the file table to " << std::filesystem::temp_directory_path() << "\n";
+            return EXIT_FAILURE;
+        }
+    } else if (std::filesystem::is_regular_file(options->arguments[0]) ||
+               std::filesystem::is_directory(options->arguments[0])) {
+        files.emplace(); // the traversal feeds the scan
+    }
+    if (!files) {
+        std::cerr << "Argument 1 must be a directory or a file\n";
+        return EXIT_FAILURE;
+    }
+    std::vector<std::filesystem::path> listed;
+    if (options->list) {
+        std::ifstream is(options->list.value());
+        if (!is) {
+            std::cerr << "Could not read list " << options->list.value() << "\n";
+            return EXIT_FAILURE;
+        }
+        for (std::string line; std::getline(is, line);)
+            if (!line.empty())
+                listed.push_back(std::filesystem::absolute(line).lexically_normal());
+    }
+    minigrep::Coverage coverage;
+    if (options->resume && std::filesystem::exists(options->resume.value()) && // none yet covers nothing
+        !minigrep::load_coverage(options->resume.value(), coverage)) {
+        std::cerr << "Could not read coverage report " << options->resume.value() << "\n";
+        return EXIT_FAILURE;
+    }
+    std::vector<std::string> patterns;
+    if (options->patterns) {
+        std::ifstream is(options->patterns.value());
+        for (std::string line; std::getline(is, line);)
+            if (!line.empty())
+                patterns.push_back(line);
+        if (patterns.empty()) {
+            std::cerr << "Could not read patterns " << options->patterns.value() << "\n";
+            return EXIT_FAILURE;
+        }
+        for (const auto& pattern : patterns)
+            if (minigrep::automaton_bytes({pattern}) > minigrep::Automaton::max_memory) {
+                std::cerr << "Pattern of " << pattern.size() << " bytes is too long to search for\n";
+                return EXIT_FAILURE;
+            }
+    }
+    minigrep::Marks marks;
+    marks.needle = options->patterns ? "" : options->arguments[1];
+    if (options->state && std::filesystem::exists(options->state.value()) &&
+        !minigrep::load_marks(options->state.value(), marks)) {
+        std::cerr << "Could not read state file " << options->state.value() << "\n";
+        return EXIT_FAILURE;
+    }
+    // the rows of the table in the order to search them, or none for directory order; a spilled table sorted by size
+    // cannot have all of its chunks sorted, so its files are taken largest first
+    std::vector<std::uint32_t> rows;
+    if (options->order == minigrep::Order::physical) {
+        minigrep::sort_physical(files.value());
+        rows = minigrep::physical_rows(table);
+    } else if (options->order == minigrep::Order::size_desc && table.spilled) {
+        rows = minigrep::largest_rows(table);
+    }
+    auto table_file = [&](std::size_t i) { return table.file(rows.empty() ? i : rows[i]); };
+
+    const auto searcher = options->patterns
+                              ? minigrep::Searcher(tuning.automaton_memory
+                                                       ? minigrep::shard_patterns(patterns, tuning.automaton_memory)
+                                                       : minigrep::plan_shards(patterns, tuning.automaton_streams,
+                                                                               minigrep::cache_sizes_now(),
+                                                                               tuning.cache_load_cost,
+                                                                               tuning.memory_load_cost),
+                                                   tuning.automaton_streams, minigrep::cache_size(2) / 4)
+                              : minigrep::Searcher(options->arguments[1], tuning.engine_threshold);
+    auto prepare = [&](minigrep::File& file) {
+        if (options->io)
+            file.io = options->io.value();
+        else
+            file.choose_io(tuning);
+        const long long read_size = options->lazy ? std::numeric_limits<long long>::max()
+                                                  : tuning.io_profile(file.filesystem).read_size;
+        std::vector<minigrep::FileChunk> chunks;
+        const auto whole = options->state ? marks.search(file) : minigrep::Range{0, file.size};
+        for (const auto& range : minigrep::uncovered(whole, coverage.covered(file.path))) {
+            const auto part = minigrep::chunks(file, range, read_size, searcher.needle.size());
+            chunks.insert(chunks.end(), part.begin(), part.end());
+        }
+        minigrep::mark_cold(chunks);
+        for (auto& chunk : chunks) // the probe is only needed up to here
+            chunk.file.resident.reset();
+        file.resident.reset();
+        return chunks;
+    };
+    std::vector<minigrep::FileChunk> all_chunks;
+    if (!minigrep::fed(options->order)) {
+        for (auto& file : files.value()) {
+            const auto chunks = prepare(file);
+            all_chunks.insert(all_chunks.end(), chunks.begin(), chunks.end());
+        }
+        for (std::size_t i = 0; i < table.size() && !table.spilled; ++i) {
+            auto file = table_file(i);
+            const auto chunks = prepare(file);
+            all_chunks.insert(all_chunks.end(), chunks.begin(), chunks.end());
+        }
+    }
+    if (options->order == minigrep::Order::size_desc)
+        minigrep::sort_largest_first(all_chunks);
+
+    minigrep::Feed feed;
+    std::jthread traversal;
+    if (minigrep::fed(options->order)) {
+        traversal = std::jthread([&](std::stop_token stop) {
+            // listed files inside the searched path come first, in the order of the list
+            const auto root = std::filesystem::absolute(options->arguments[0]).lexically_normal();
+            std::set<std::filesystem::path> seen;
+            for (const auto& path : listed) {
+                const auto relative = path.lexically_relative(root);
+                if (relative.empty() || *relative.begin() == ".." || !std::filesystem::is_regular_file(path) ||
+                    !seen.insert(path).second)
+                    continue;
+                // named the way the traversal would name it
+                const std::filesystem::path argument(options->arguments[0]);
+                minigrep::File file((relative == "." ? argument : argument / relative).string());
+                feed.push(prepare(file), static_cast<long long>(seen.size()));
+            }
+            const long long rest = static_cast<long long>(seen.size()) + 1;
+            auto visit = [&](minigrep::File file) {
+                if (seen.empty() || !seen.contains(std::filesystem::absolute(file.path).lexically_normal()))
+                    feed.push(prepare(file), options->order == minigrep::Order::list
+                                                 ? rest
+                                                 : minigrep::priority(file, options->order));
+                return !stop.stop_requested();
+            };
+            if (options->index) {
+                for (auto& file : files.value())
+                    if (!visit(std::move(file)))
+                        break;
+            } else {
+                walk(visit);
+            }
+            feed.close();
+        });
+    }
+
+    minigrep::Schedule schedule;
+    schedule.trace = options->trace ? &std::cerr : nullptr;
+    schedule.hedge = options->hedge;
+    schedule.lazy = options->lazy;
+    schedule.feed = minigrep::fed(options->order) ? &feed : nullptr;
+    std::size_t row = 0;
+    if (table.spilled) // the files are made into chunks as the scan reaches them
+        schedule.source = [&]() -> std::optional<std::vector<minigrep::FileChunk>> {
+            if (row == table.size())
+                return std::nullopt;
+            auto file = table_file(row++);
+            if (row % minigrep::FileTable::release_rows == 0)
+                table.release();
+            return prepare(file);
+        };
+    schedule.coverage = options->coverage ? &coverage : nullptr;
+    if (options->time_budget)
+        schedule.deadline = start + std::chrono::milliseconds(options->time_budget.value());
+    std::optional<minigrep::Sorter> sorter;
+    if (options->sorted)
+        schedule.sorter = &sorter.emplace(tuning.sort_memory, std::max(tuning.max_workers, 1), tuning.sort_fanin);
+    // sorted output is merged by a single writer, otherwise the workers write their chunks to the file themselves
+    std::ofstream sorted_output;
+    std::optional<minigrep::Output> output;
+    if (options->output && options->sorted)
+        sorted_output.open(options->output.value());
+    else if (options->output)
+        schedule.output = &output.emplace(options->output.value(), !options->lazy && !minigrep::fed(options->order));
+    if (options->output && (options->sorted ? !sorted_output : output->fd < 0)) {
+        std::cerr << "Could not write output file " << options->output.value() << "\n";
+        return EXIT_FAILURE;
+    }
+    std::ostream& os = options->sorted && options->output ? sorted_output : std::cout;
+    minigrep::Costs costs;
+    schedule.costs = options->profile_files ? &costs : nullptr;
+    minigrep::Stats stats;
+    bool written = true;
+    const double elapsed = minigrep::seconds([&] {
+        minigrep::scan(all_chunks, searcher, tuning, os, stats, schedule);
+        if (sorter && !sorter->finish(os))
+            std::cerr << "minigrep: could not write sorted runs to " << sorter->directory << ", output incomplete\n";
+        written = output ? output->finish() : static_cast<bool>(os.flush());
+    });
+    traversal.request_stop();
+    if (traversal.joinable())
+        traversal.join();
+    if (listing.complete && !minigrep::save_snapshot(options->snapshot.value(), listing)) {
+        std::cerr << "Could not write snapshot " << options->snapshot.value() << "\n";
+        return EXIT_FAILURE;
+    }
+    if (options->output && !written) {
+        std::cerr << "Could not write output file " << options->output.value() << "\n";
+        return EXIT_FAILURE;
+    }
+    // a file is only searched up to its mark if every chunk of it was searched
+    if (options->state && (stats.expired || stats.timeouts > 0)) {
+        std::cerr << "minigrep: not every chunk was searched, state file " << options->state.value() << " kept\n";
+    } else if (options->state && !minigrep::save_marks(options->state.value(), marks)) {
+        std::cerr << "Could not write state file " << options->state.value() << "\n";
+        return EXIT_FAILURE;
+    }
+    if (options->coverage && !minigrep::save_coverage(options->coverage.value(), coverage)) {
+        std::cerr << "Could not write coverage report " << options->coverage.value() << "\n";
+        return EXIT_FAILURE;
+    }
+    if (stats.expired)
+        std::cerr << "minigrep: time budget expired after searching " << stats.bytes << " bytes"
+                  << (options->coverage ? ", resume with --resume=" + options->coverage->string() : "") << "\n";
+    if (options->stats)
+        minigrep::print_stats(std::cerr, tuning, profile, searcher, stats, elapsed);
+    if (options->stats && table.size() > 0)
+        std::cerr << "file table: " << table.size() << " files, " << table.bytes() / 1e6 << " MB"
+                  << (table.spilled ? " (spilled)" : "") << "\n";
+    if (options->stats && options->snapshot)
+        std::cerr << "snapshot: " << listing.reused << " directories reused, " << listing.listed << " listed\n";
+    if (options->profile_files)
+        costs.print(std::cerr, options->profile_files.value());
+}
 
-    std::vector<std::future<void>> futures;
-    for (auto& chunk : all_chunks)
-        futures.push_back(std::async(std::launch::async, minigrep::search, std::ref(chunk), argv[2]));
-}
\ No newline at end of file
+#endif
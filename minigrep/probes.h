@@ -0,0 +1,60 @@
+#pragma once
+
+/**
+ * Statically defined tracing probes in the format of SystemTap's <sys/sdt.h>, which bpftrace, perf and SystemTap read
+ * from the .note.stapsdt section of the binary (for example `bpftrace -l 'usdt:./minigrep:*'`).
+ * A probe compiles to a single nop at the probe site plus a note recording its address and where each argument lives
+ * there, so it costs one nop while no tracer is attached; an attached tracer replaces the nop with a breakpoint.
+ * The arguments are passed as signed 64 bit values, pointers to paths included, and are only evaluated as far as the
+ * compiler needs them in a register or in memory anyway.
+ * Defining MINIGREP_NO_PROBES, or building for an architecture other than x86-64 and AArch64, compiles them out.
+ */
+
+#if (defined(__x86_64__) || defined(__aarch64__)) && !defined(MINIGREP_NO_PROBES)
+
+#define MINIGREP_PROBE_STRING(x) #x
+
+#define MINIGREP_PROBE_(name, arguments, ...)                                                                          \
+    __asm__ __volatile__("990: nop\n"                                                                                 \
+                         ".pushsection .note.stapsdt,\"\",\"note\"\n"                                                 \
+                         ".balign 4\n"                                                                                \
+                         ".4byte 992f-991f, 994f-993f, 3\n"                                                           \
+                         "991: .asciz \"stapsdt\"\n"                                                                  \
+                         "992: .balign 4\n"                                                                           \
+                         "993: .8byte 990b\n"                                                                         \
+                         ".8byte _.stapsdt.base\n"                                                                    \
+                         ".8byte 0\n"                                                                                 \
+                         ".asciz \"minigrep\"\n"                                                                      \
+                         ".asciz \"" MINIGREP_PROBE_STRING(name) "\"\n"                                               \
+                         ".asciz \"" arguments "\"\n"                                                                 \
+                         "994: .balign 4\n"                                                                           \
+                         ".popsection\n"                                                                              \
+                         ".ifndef _.stapsdt.base\n"                                                                   \
+                         ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"                      \
+                         ".weak _.stapsdt.base\n"                                                                     \
+                         ".hidden _.stapsdt.base\n"                                                                   \
+                         "_.stapsdt.base: .space 1\n"                                                                 \
+                         ".size _.stapsdt.base, 1\n"                                                                  \
+                         ".popsection\n"                                                                              \
+                         ".endif\n"                                                                                   \
+                         :                                                                                            \
+                         : __VA_ARGS__)
+
+#define MINIGREP_PROBE_ARGUMENT(x) "nor"((long long)(x))
+
+#define MINIGREP_PROBE2(name, a, b)                                                                                    \
+    MINIGREP_PROBE_(name, "-8@%0 -8@%1", MINIGREP_PROBE_ARGUMENT(a), MINIGREP_PROBE_ARGUMENT(b))
+#define MINIGREP_PROBE3(name, a, b, c)                                                                                 \
+    MINIGREP_PROBE_(name, "-8@%0 -8@%1 -8@%2", MINIGREP_PROBE_ARGUMENT(a), MINIGREP_PROBE_ARGUMENT(b),              \
+                    MINIGREP_PROBE_ARGUMENT(c))
+#define MINIGREP_PROBE4(name, a, b, c, d)                                                                              \
+    MINIGREP_PROBE_(name, "-8@%0 -8@%1 -8@%2 -8@%3", MINIGREP_PROBE_ARGUMENT(a), MINIGREP_PROBE_ARGUMENT(b),        \
+                    MINIGREP_PROBE_ARGUMENT(c), MINIGREP_PROBE_ARGUMENT(d))
+
+#else
+
+#define MINIGREP_PROBE2(name, a, b) ((void)0)
+#define MINIGREP_PROBE3(name, a, b, c) ((void)0)
+#define MINIGREP_PROBE4(name, a, b, c, d) ((void)0)
+
+#endif